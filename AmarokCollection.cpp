@@ -27,13 +27,124 @@
 
 #include <mysql/mysql.h>
 #include "AmarokCollection.h"
+#include "FileStore.h"
 
 #include <iostream>
+#include <cstring>
 
 #include <kstandarddirs.h>
 #include <kglobal.h>
 #include <QtCore/QString>
 #include <QtCore/QDir>
+#include <QtCore/QMutexLocker>
+#include <QtCore/QThreadStorage>
+#include <QtCore/QtAlgorithms>
+
+// Builds a snapshot from rows (u.id, s.id, u.deviceid, u.rpath, s.rating)
+class SnapshotBuilder : public AmarokRowHandler
+{
+    const AmarokCollection &m_collection;
+    QHash<QString, AmarokTrack> &m_snapshot;
+public:
+    SnapshotBuilder(const AmarokCollection &iCollection, QHash<QString, AmarokTrack> &oSnapshot)
+        : m_collection(iCollection), m_snapshot(oSnapshot) {}
+    bool row(const char* const* iFields, const unsigned long*, unsigned int)
+    {
+        AmarokTrack track;
+        track.urlId = QString(iFields[0]).toInt();
+        track.statisticsId = (iFields[1] != NULL) ? QString(iFields[1]).toInt() : 0;
+        track.rating = (iFields[4] != NULL) ? QString(iFields[4]).toInt() : 0;
+        m_snapshot.insert(m_collection.devicePath(QString(iFields[2]).toInt(), iFields[3]), track);
+        return true;
+    }
+};
+
+// Passes rows (u.deviceid, u.rpath, s.rating) with a rating to a rating handler
+class RatingRowReader : public AmarokRowHandler
+{
+    const AmarokCollection &m_collection;
+    AmarokRatingHandler &m_handler;
+public:
+    RatingRowReader(const AmarokCollection &iCollection, AmarokRatingHandler &iHandler)
+        : m_collection(iCollection), m_handler(iHandler) {}
+    bool row(const char* const* iFields, const unsigned long*, unsigned int)
+    {
+        int rating = QString(iFields[2]).toInt();
+        if (rating > 0)
+        {
+            return m_handler.rating(m_collection.devicePath(QString(iFields[0]).toInt(), iFields[1]), rating);
+        }
+        // else, no rating for this URL
+        return true;
+    }
+};
+
+class RatingMapBuilder : public AmarokRatingHandler
+{
+    QMap<QString, int> &m_ratings;
+public:
+    RatingMapBuilder(QMap<QString, int> &oRatings) : m_ratings(oRatings) {}
+    bool rating(const QString &iUrl, int iRating)
+    {
+        m_ratings[iUrl] = iRating;
+        return true;
+    }
+};
+
+// Entry of a scan, with its key
+struct KeyedEntry
+{
+    QByteArray key;
+    StoreEntry entry;
+    bool operator<(const KeyedEntry &iOther) const { return qstrcmp(key, iOther.key) < 0; }
+};
+
+class AmarokCursor : public StoreCursor
+{
+public:
+    QList<KeyedEntry> m_entries;
+    bool next(StoreEntry &oEntry)
+    {
+        if (m_entries.isEmpty())
+        {
+            return false;
+        }
+        oEntry = m_entries.takeFirst().entry;
+        return true;
+    }
+};
+
+// The embedded server must be initialized in each thread that uses the connection
+class MysqlThread
+{
+public:
+    MysqlThread() { mysql_thread_init(); }
+    ~MysqlThread() { mysql_thread_end(); }
+};
+
+static QThreadStorage<MysqlThread*> mysqlThread;
+
+static void attachThread()
+{
+    if (!mysqlThread.hasLocalData())
+    {
+        mysqlThread.setLocalData(new MysqlThread());
+    }
+}
+
+AmarokCollection::~AmarokCollection()
+{
+    if (m_db)
+    {
+        flushRatings();
+    }
+    if (m_lookupStmt)
+        mysql_stmt_close(m_lookupStmt);
+    if (m_insertStmt)
+        mysql_stmt_close(m_insertStmt);
+    if (m_updateStmt)
+        mysql_stmt_close(m_updateStmt);
+}
 
 bool AmarokCollection::connect()
 {
@@ -126,192 +237,630 @@ bool AmarokCollection::connect()
     {
         std::cout << "Connected to MySQLe server" << mysql_get_server_info( m_db ) << std::endl;
     }
-    return true;
+    return loadDevices() && prepareStatements();
 }
 
-bool AmarokCollection::getRating(QString iUrl, bool &oUrlPresent, int &oRating)
+bool AmarokCollection::loadDevices()
 {
     MYSQL_RES *result;
     MYSQL_ROW row;
-    oUrlPresent = false;
-    oRating = 0;
 
-    std::string utf8Url(iUrl.toLocal8Bit());
-    char escapedUrl[utf8Url.length() *2 +1];
-    mysql_real_escape_string(m_db, escapedUrl, utf8Url.c_str(), utf8Url.length());
-    std::string query("SELECT s.rating FROM devices d, urls u LEFT OUTER JOIN statistics s ON s.url=u.id WHERE u.deviceid=d.id AND CONCAT(TRIM(TRAILING '/' FROM d.lastmountpoint), SUBSTRING(u.rpath, 2))='" + std::string(escapedUrl) + "'");
-    if (mysql_query(m_db, query.c_str()) != 0)
+    if (mysql_query(m_db, "SELECT id, lastmountpoint FROM devices") != 0)
     {
-        std::cout << "Error in Mysqle query to retrieve rating from url" << std::endl;
+        std::cout << "Error in Mysqle query to retrieve devices" << std::endl;
         std::cout << "Error: " << mysql_error(m_db) << std::endl;
         return false;
     }
     if (!(result = mysql_store_result(m_db)))
     {
-        std::cout << "Error in storing results of Mysqle query to retrieve rating from url" << std::endl;
+        std::cout << "Error in storing results of Mysqle query to retrieve devices" << std::endl;
         std::cout << "Error: " << mysql_error(m_db) << std::endl;
         return false;
     }
 
-    if ((row = mysql_fetch_row(result)) != 0)
+    m_devices.clear();
+    while ((row = mysql_fetch_row(result)) != 0)
     {
-        oUrlPresent = true;
-        if (row[0] != NULL)
+        if (row[1] == NULL)
         {
-            QString s_rating(row[0]);
-            oRating = s_rating.toInt();
+            continue;
         }
-        // else, no rating for this URL
+        // Same as TRIM(TRAILING '/' FROM d.lastmountpoint)
+        QString mountPoint = QString::fromLocal8Bit(row[1]);
+        while (mountPoint.endsWith('/'))
+        {
+            mountPoint.chop(1);
+        }
+        int i = 0;
+        while (i < m_devices.size() && m_devices[i].second.length() >= mountPoint.length())
+        {
+            i++;
+        }
+        m_devices.insert(i, qMakePair(QString(row[0]).toInt(), mountPoint));
     }
-    // else, no URL
-
     mysql_free_result(result);
+
+    if (m_isVerbose)
+    {
+        for (int i=0; i<m_devices.size(); i++)
+        {
+            std::cout << "Amarok device " << m_devices[i].first << " mounted on " << std::string(m_devices[i].second.toLocal8Bit()) << "/" << std::endl;
+        }
+    }
     return true;
 }
 
-bool AmarokCollection::getAllRating(QString iUrl, QMap<QString, int> &oRatings)
+// Absolute path of a url, as CONCAT(TRIM(TRAILING '/' FROM d.lastmountpoint), SUBSTRING(u.rpath, 2))
+QString AmarokCollection::devicePath(int iDeviceId, const char* iRpath) const
 {
-    MYSQL_RES *result;
-    MYSQL_ROW row;
+    for (int i=0; i<m_devices.size(); i++)
+    {
+        if (m_devices[i].first == iDeviceId)
+        {
+            return m_devices[i].second + QString::fromLocal8Bit(*iRpath ? iRpath + 1 : iRpath);
+        }
+    }
+    return QString();
+}
 
-    std::string utf8Url(iUrl.toLocal8Bit());
-    char escapedUrl[utf8Url.length() *2 +1];
-    mysql_real_escape_string(m_db, escapedUrl, utf8Url.c_str(), utf8Url.length());
-    std::string query("SELECT CONCAT(TRIM(TRAILING '/' FROM d.lastmountpoint), SUBSTRING(u.rpath, 2)), rating FROM statistics s, urls u, devices d WHERE s.url=u.id AND u.deviceid=d.id AND CONCAT(TRIM(TRAILING '/' FROM d.lastmountpoint), SUBSTRING(u.rpath, 2)) LIKE '" + std::string(escapedUrl) + "%'");
-    if (mysql_query(m_db, query.c_str()) != 0)
+// (deviceid, rpath) candidates for an absolute path, most specific mount point first
+QList< QPair<int, QString> > AmarokCollection::splitUrl(const QString &iUrl) const
+{
+    QList< QPair<int, QString> > candidates;
+    for (int i=0; i<m_devices.size(); i++)
     {
-        std::cout << "Error in Mysqle query to retrieve rating from url" << std::endl;
-        std::cout << "Error: " << mysql_error(m_db) << std::endl;
-        return false;
+        const QString &mountPoint = m_devices[i].second;
+        if (iUrl.startsWith(mountPoint + '/'))
+        {
+            candidates.append(qMakePair(m_devices[i].first, "." + iUrl.mid(mountPoint.length())));
+        }
     }
-    if (!(result = mysql_store_result(m_db)))
+    return candidates;
+}
+
+// SQL condition selecting all urls under iDirectory (or directly in iDirectory if not iRecursive),
+// as ranges of urls(deviceid, rpath) index. oDeviceIds receives the devices involved.
+// Returns an empty string if no device can hold such urls.
+std::string AmarokCollection::directoryCondition(const QString &iDirectory, bool iRecursive, QList<int> &oDeviceIds) const
+{
+    std::string condition;
+    oDeviceIds.clear();
+    for (int i=0; i<m_devices.size(); i++)
     {
-        std::cout << "Error in storing results of Mysqle query to retrieve rating from url" << std::endl;
-        std::cout << "Error: " << mysql_error(m_db) << std::endl;
-        return false;
+        const QString &mountPoint = m_devices[i].second;
+        QString prefix;
+        if (iDirectory == mountPoint || iDirectory.startsWith(mountPoint + '/'))
+        {
+            prefix = "." + iDirectory.mid(mountPoint.length()) + "/";
+        }
+        else if (iRecursive && mountPoint.startsWith(iDirectory + '/'))
+        {
+            // The whole device is under iDirectory
+            prefix = "./";
+        }
+        else
+        {
+            continue;
+        }
+        // rpath starts with prefix <=> prefix <= rpath < prefix with final '/' replaced by '0' (next character)
+        QString upperBound(prefix);
+        upperBound[upperBound.length()-1] = '0';
+
+        if (!condition.empty())
+            condition += " OR ";
+        condition += "(u.deviceid=" + QString::number(m_devices[i].first).toStdString()
+                   + " AND u.rpath>='" + escape(prefix) + "' AND u.rpath<'" + escape(upperBound) + "'";
+        if (!iRecursive)
+        {
+            // No other '/' after the prefix. Checked on the index entries, before reading any row.
+            QString pattern(prefix);
+            pattern.replace("\\", "\\\\").replace("%", "\\%").replace("_", "\\_");
+            condition += " AND u.rpath NOT LIKE '" + escape(pattern) + "%/%'";
+        }
+        condition += ")";
+        oDeviceIds.append(m_devices[i].first);
     }
+    return condition;
+}
 
-    while ((row = mysql_fetch_row(result)) != 0)
+// SQL expression sorting urls of iDeviceIds by absolute path.
+// With a single device, this is the rpath itself, so rows come in urls index order.
+std::string AmarokCollection::pathExpression(const QList<int> &iDeviceIds) const
+{
+    if (iDeviceIds.size() == 1)
     {
-        int rating = QString(row[1]).toInt();
-        if (rating > 0)
+        return "u.rpath";
+    }
+    std::string expression("CONCAT(CASE u.deviceid");
+    for (int i=0; i<m_devices.size(); i++)
+    {
+        if (iDeviceIds.contains(m_devices[i].first))
         {
-            oRatings[QString::fromLocal8Bit(row[0])] = rating;
+            expression += " WHEN " + QString::number(m_devices[i].first).toStdString() + " THEN '" + escape(m_devices[i].second) + "'";
         }
     }
-    // else, no rating for this URL
+    expression += " END, SUBSTRING(u.rpath, 2))";
+    return expression;
+}
 
-    mysql_free_result(result);
+std::string AmarokCollection::escape(const QString &iString) const
+{
+    QByteArray utf8String(iString.toLocal8Bit());
+    QByteArray escapedString(utf8String.length() *2 +1, '\0');
+    unsigned long length = mysql_real_escape_string(m_db, escapedString.data(), utf8String.constData(), utf8String.length());
+    return std::string(escapedString.constData(), length);
+}
+
+MYSQL_STMT* AmarokCollection::prepareStatement(const char* iQuery)
+{
+    MYSQL_STMT* stmt = mysql_stmt_init(m_db);
+    if (!stmt)
+    {
+        std::cout << "Error: Mysqle statement initialization failed" << std::endl;
+        return 0;
+    }
+    if (mysql_stmt_prepare(stmt, iQuery, strlen(iQuery)) != 0)
+    {
+        std::cout << "Error in preparing Mysqle statement: " << iQuery << std::endl;
+        std::cout << "Error: " << mysql_stmt_error(stmt) << std::endl;
+        mysql_stmt_close(stmt);
+        return 0;
+    }
+    return stmt;
+}
+
+// Statements executed for each file are parsed once here, then only their parameters are bound
+bool AmarokCollection::prepareStatements()
+{
+    m_lookupStmt = prepareStatement("SELECT u.id, s.id, s.rating FROM urls u LEFT OUTER JOIN statistics s ON s.url=u.id WHERE u.deviceid=? AND u.rpath=?");
+    m_insertStmt = prepareStatement("INSERT INTO statistics(url, rating) VALUES(?, ?)");
+    m_updateStmt = prepareStatement("UPDATE statistics SET rating=? WHERE url=?");
+    return m_lookupStmt && m_insertStmt && m_updateStmt;
+}
+
+bool AmarokCollection::loadSnapshot(QString iDirectory)
+{
+    QMutexLocker locker(&m_mutex);
+    attachThread();
+    // Fetch every url under iDirectory in a single query, instead of one query per file
+    m_snapshot.clear();
+    QList<int> deviceIds;
+    std::string condition = directoryCondition(iDirectory, true, deviceIds);
+    if (!condition.empty())
+    {
+        SnapshotBuilder builder(*this, m_snapshot);
+        if (!streamQuery("SELECT u.id, s.id, u.deviceid, u.rpath, s.rating FROM urls u LEFT OUTER JOIN statistics s ON s.url=u.id WHERE " + condition, builder))
+        {
+            std::cout << "Error: cannot retrieve collection snapshot" << std::endl;
+            m_snapshot.clear();
+            return false;
+        }
+    }
+    // else, no Amarok device holds this directory
+
+    m_snapshotDirectory = iDirectory;
+    m_hasSnapshot = true;
+    if (m_isVerbose)
+    {
+        std::cout << "Loaded " << m_snapshot.size() << " Amarok urls under " << std::string(iDirectory.toLocal8Bit()) << std::endl;
+    }
     return true;
 }
 
-// Prerequisite to call this method: iUrl is present in Amarok collection
-// (please test with getRating before)
-bool AmarokCollection::setRating(QString iUrl, int iRating)
+void AmarokCollection::clearSnapshot()
 {
-    MYSQL_RES *result;
-    MYSQL_ROW row;
+    QMutexLocker locker(&m_mutex);
+    m_hasSnapshot = false;
+    m_snapshot.clear();
+}
 
-    std::string utf8Url(iUrl.toLocal8Bit());
-    char escapedUrl[utf8Url.length() *2 +1];
-    mysql_real_escape_string(m_db, escapedUrl, utf8Url.c_str(), utf8Url.length());
-    std::string query("SELECT u.id, s.id from devices d, urls u LEFT OUTER JOIN statistics s ON s.url=u.id WHERE u.deviceid=d.id AND CONCAT(TRIM(TRAILING '/' FROM d.lastmountpoint), SUBSTRING(u.rpath, 2))='" + std::string(escapedUrl) + "'");
-    if (mysql_query(m_db, query.c_str()) != 0)
+// True if iUrl is covered by the snapshot: absence from the snapshot then means absence from the collection
+bool AmarokCollection::inSnapshot(const QString &iUrl) const
+{
+    return m_hasSnapshot
+        && iUrl.length() > m_snapshotDirectory.length()
+        && iUrl.startsWith(m_snapshotDirectory)
+        && iUrl[m_snapshotDirectory.length()] == '/';
+}
+
+bool AmarokCollection::lookupTrack(QString iUrl, bool &oUrlPresent, AmarokTrack &oTrack)
+{
+    oUrlPresent = false;
+    oTrack.urlId = 0;
+    oTrack.statisticsId = 0;
+    oTrack.rating = 0;
+
+    if (inSnapshot(iUrl))
     {
-        std::cout << "Error in Mysqle query to retrieve rating from url" << std::endl;
-        std::cout << "Error: " << mysql_error(m_db) << std::endl;
-        return false;
+        QHash<QString, AmarokTrack>::const_iterator i = m_snapshot.constFind(iUrl);
+        if (i != m_snapshot.constEnd())
+        {
+            oUrlPresent = true;
+            oTrack = i.value();
+        }
+        return true;
     }
-    if (!(result = mysql_store_result(m_db)))
+
+    int deviceId = 0;
+    QByteArray utf8Rpath;
+    unsigned long rpathLength = 0;
+    MYSQL_BIND params[2];
+    memset(params, 0, sizeof(params));
+    params[0].buffer_type = MYSQL_TYPE_LONG;
+    params[0].buffer = &deviceId;
+    params[1].buffer_type = MYSQL_TYPE_STRING;
+    params[1].length = &rpathLength;
+
+    int values[3] = {0, 0, 0};
+    my_bool isNull[3] = {0, 0, 0};
+    MYSQL_BIND columns[3];
+    memset(columns, 0, sizeof(columns));
+    for (int i=0; i<3; i++)
+    {
+        columns[i].buffer_type = MYSQL_TYPE_LONG;
+        columns[i].buffer = &values[i];
+        columns[i].is_null = &isNull[i];
+    }
+
+    // Try each device which may hold this url, until it is found
+    QList< QPair<int, QString> > candidates = splitUrl(iUrl);
+    for (int c=0; c<candidates.size() && !oUrlPresent; c++)
+    {
+        deviceId = candidates[c].first;
+        utf8Rpath = candidates[c].second.toLocal8Bit();
+        rpathLength = utf8Rpath.length();
+        params[1].buffer = utf8Rpath.data();
+        params[1].buffer_length = rpathLength;
+
+        if (   mysql_stmt_bind_param(m_lookupStmt, params) != 0
+            || mysql_stmt_execute(m_lookupStmt) != 0
+            || mysql_stmt_bind_result(m_lookupStmt, columns) != 0
+            || mysql_stmt_store_result(m_lookupStmt) != 0)
+        {
+            std::cout << "Error in Mysqle query to retrieve rating from url" << std::endl;
+            std::cout << "Error: " << mysql_stmt_error(m_lookupStmt) << std::endl;
+            mysql_stmt_free_result(m_lookupStmt);
+            return false;
+        }
+
+        if (mysql_stmt_fetch(m_lookupStmt) == 0)
+        {
+            oUrlPresent = true;
+            oTrack.urlId = values[0];
+            if (!isNull[1])
+            {
+                oTrack.statisticsId = values[1];
+            }
+            if (!isNull[2])
+            {
+                oTrack.rating = values[2];
+            }
+            // else, no rating for this URL
+        }
+        // else, no URL on this device
+
+        mysql_stmt_free_result(m_lookupStmt);
+    }
+    return true;
+}
+
+bool AmarokCollection::getRating(QString iUrl, bool &oUrlPresent, int &oRating)
+{
+    QMutexLocker locker(&m_mutex);
+    attachThread();
+    AmarokTrack track;
+    bool ok = lookupTrack(iUrl, oUrlPresent, track);
+    oRating = track.rating;
+    return ok;
+}
+
+bool AmarokCollection::getAllRating(QString iUrl, QMap<QString, int> &oRatings, bool iRecursive)
+{
+    RatingMapBuilder builder(oRatings);
+    return getAllRating(iUrl, builder, iRecursive);
+}
+
+// Stream all ratings under directory iUrl to iHandler, sorted by path, without loading them in memory
+bool AmarokCollection::getAllRating(QString iUrl, AmarokRatingHandler &iHandler, bool iRecursive)
+{
+    QMutexLocker locker(&m_mutex);
+    attachThread();
+    QList<int> deviceIds;
+    std::string condition = directoryCondition(iUrl, iRecursive, deviceIds);
+    if (condition.empty())
+    {
+        // No Amarok device holds this directory
+        return true;
+    }
+    RatingRowReader reader(*this, iHandler);
+    return streamQuery("SELECT u.deviceid, u.rpath, s.rating FROM statistics s, urls u WHERE s.url=u.id AND s.rating>0 AND (" + condition + ") ORDER BY " + pathExpression(deviceIds), reader);
+}
+
+// Prerequisite to call this method: iUrl is present in Amarok collection
+// (please test with getRating before)
+bool AmarokCollection::setRating(QString iUrl, int iRating)
+{
+    QMutexLocker locker(&m_mutex);
+    attachThread();
+    bool urlPresent = false;
+    AmarokTrack track;
+    if (!lookupTrack(iUrl, urlPresent, track))
     {
-        std::cout << "Error in storing results of Mysqle query to retrieve rating from url" << std::endl;
-        std::cout << "Error: " << mysql_error(m_db) << std::endl;
         return false;
     }
-    if ((row = mysql_fetch_row(result)) == 0)
+    if (!urlPresent)
     {
         std::cout << "Error: method setRating should be called only if Url is present in Amarok collection" << std::endl;
         return false;
     }
     else
     {
-        if (row[1] == NULL)
+        if (track.statisticsId == 0)
         {
             //---------------------------------------
             // There is no statistic row in database
 
-            QString queryInsert("INSERT INTO statistics(url, rating) VALUES('%1', '%2')");
-            queryInsert = queryInsert.arg(QString(row[0]), QString::number(iRating));
-            //std::cout << queryInsert.toStdString() << std::endl;
-            if (mysql_query(m_db, queryInsert.toStdString().c_str()) != 0)
+            int values[2] = {track.urlId, iRating};
+            MYSQL_BIND params[2];
+            memset(params, 0, sizeof(params));
+            for (int i=0; i<2; i++)
+            {
+                params[i].buffer_type = MYSQL_TYPE_LONG;
+                params[i].buffer = &values[i];
+            }
+            if (   mysql_stmt_bind_param(m_insertStmt, params) != 0
+                || mysql_stmt_execute(m_insertStmt) != 0)
             {
                 std::cout << "Error in Mysqle query to insert rating" << std::endl;
-                std::cout << "Error: " << mysql_error(m_db) << std::endl;
+                std::cout << "Error: " << mysql_stmt_error(m_insertStmt) << std::endl;
                 return false;
             }
+            track.statisticsId = mysql_stmt_insert_id(m_insertStmt);
         }
         else
         {
             //----------------------------------------------
             // There is already a statistic row in database
 
-            QString queryUpdate("UPDATE statistics SET rating='%1' WHERE url='%2'");
-            queryUpdate = queryUpdate.arg(QString::number(iRating), QString(row[0]));
-            //std::cout << queryUpdate.toStdString() << std::endl;
-            if (mysql_query(m_db, queryUpdate.toStdString().c_str()) != 0)
+            int values[2] = {iRating, track.urlId};
+            MYSQL_BIND params[2];
+            memset(params, 0, sizeof(params));
+            for (int i=0; i<2; i++)
+            {
+                params[i].buffer_type = MYSQL_TYPE_LONG;
+                params[i].buffer = &values[i];
+            }
+            if (   mysql_stmt_bind_param(m_updateStmt, params) != 0
+                || mysql_stmt_execute(m_updateStmt) != 0)
             {
                 std::cout << "Error in Mysqle query to update rating" << std::endl;
-                std::cout << "Error: " << mysql_error(m_db) << std::endl;
+                std::cout << "Error: " << mysql_stmt_error(m_updateStmt) << std::endl;
                 return false;
             }
         }
     }
+
+    // Keep the snapshot in line with the database
+    if (inSnapshot(iUrl))
+    {
+        track.rating = iRating;
+        m_snapshot.insert(iUrl, track);
+    }
     return true;
 }
 
+// Same prerequisite as setRating. The change is only written to the database
+// when m_batchSize changes are pending, or when flushRatings is called.
+bool AmarokCollection::queueRating(QString iUrl, int iRating)
+{
+    QMutexLocker locker(&m_mutex);
+    attachThread();
+    bool urlPresent = false;
+    AmarokTrack track;
+    if (!lookupTrack(iUrl, urlPresent, track))
+    {
+        return false;
+    }
+    if (!urlPresent)
+    {
+        std::cout << "Error: method queueRating should be called only if Url is present in Amarok collection" << std::endl;
+        return false;
+    }
+
+    return queueTrack(iUrl, track, iRating);
+}
 
-bool AmarokCollection::query(QString iQuery, QList<QString> &oResult)
+// Called with m_mutex locked, for a track found by lookupTrack
+bool AmarokCollection::queueTrack(const QString &iUrl, AmarokTrack &ioTrack, int iRating)
+{
+    m_pendingRatings.append(qMakePair(ioTrack.urlId, iRating));
+    if (inSnapshot(iUrl))
+    {
+        if (ioTrack.statisticsId == 0)
+        {
+            ioTrack.statisticsId = -1;
+        }
+        ioTrack.rating = iRating;
+        m_snapshot.insert(iUrl, ioTrack);
+    }
+
+    // After a failed batch, its ratings are retried once a full batch of new ratings is pending
+    if (m_pendingRatings.size() - m_nbRetriedRatings >= m_batchSize)
+    {
+        return writePendingRatings();
+    }
+    return true;
+}
+
+// Write pending changes as one multi-row statement. There is no transaction: Amarok tables are MyISAM,
+// so each batch is written on its own. statistics.url is a unique key in Amarok schema, so existing rows
+// are updated in place. The ratings of a failed batch stay pending, and are retried with the next batch.
+bool AmarokCollection::writePendingRatings()
+{
+    if (m_pendingRatings.isEmpty())
+    {
+        return true;
+    }
+
+    QString queryInsert("INSERT INTO statistics(url, rating) VALUES ");
+    for (int i=0; i<m_pendingRatings.size(); i++)
+    {
+        if (i>0)
+            queryInsert += ",";
+        queryInsert += QString("(%1,%2)").arg(m_pendingRatings[i].first).arg(m_pendingRatings[i].second);
+    }
+    queryInsert += " ON DUPLICATE KEY UPDATE rating=VALUES(rating)";
+    if (m_isVerbose)
+    {
+        std::cout << "Writing " << m_pendingRatings.size() << " ratings to Amarok collection" << std::endl;
+    }
+
+    if (mysql_query(m_db, queryInsert.toStdString().c_str()) != 0)
+    {
+        std::cout << "Error in Mysqle query to write ratings" << std::endl;
+        std::cout << "Error: " << mysql_error(m_db) << std::endl;
+        m_nbRetriedRatings = m_pendingRatings.size();
+        return false;
+    }
+    m_nbWrittenRatings += m_pendingRatings.size();
+    m_nbRetriedRatings = 0;
+    m_pendingRatings.clear();
+    return true;
+}
+
+// Write all pending changes. Ratings which still cannot be written are dropped and counted.
+bool AmarokCollection::flushRatings()
+{
+    QMutexLocker locker(&m_mutex);
+    attachThread();
+    bool ok = writePendingRatings();
+    if (!ok)
+    {
+        std::cout << "Error: " << m_pendingRatings.size() << " Amarok ratings could not be written ("
+                  << m_nbWrittenRatings << " written)" << std::endl;
+        m_pendingRatings.clear();
+    }
+    else if (m_isVerbose && m_nbWrittenRatings > 0)
+    {
+        std::cout << "Amarok ratings written: " << m_nbWrittenRatings << std::endl;
+    }
+    m_nbWrittenRatings = 0;
+    m_nbRetriedRatings = 0;
+    return ok;
+}
+
+bool AmarokCollection::query(QString iQuery, AmarokRowHandler &iHandler)
+{
+    QMutexLocker locker(&m_mutex);
+    attachThread();
+    QByteArray localQuery(iQuery.toLocal8Bit());
+    return streamQuery(std::string(localQuery.constData(), localQuery.length()), iHandler);
+}
+
+// Run iQuery and pass its rows to iHandler as they are read, without storing the whole result
+bool AmarokCollection::streamQuery(const std::string &iQuery, AmarokRowHandler &iHandler)
 {
     MYSQL_RES *result;
     MYSQL_FIELD *fields;
     MYSQL_ROW row;
     unsigned int num_fields = 0;
 
-    if (mysql_query(m_db, iQuery.toLocal8Bit()) != 0)
+    if (mysql_real_query(m_db, iQuery.data(), iQuery.length()) != 0)
     {
         std::cout << "Error in Mysqle query" << std::endl;
         std::cout << "Error: " << mysql_error(m_db) << std::endl;
         return false;
     }
-    if (!(result = mysql_store_result(m_db)))
+    if (!(result = mysql_use_result(m_db)))
     {
-        std::cout << "Error in storing results of Mysqle query" << std::endl;
+        if (mysql_field_count(m_db) == 0)
+        {
+            // Statement without result set (INSERT, UPDATE...)
+            if (m_isVerbose)
+            {
+                std::cout << mysql_affected_rows(m_db) << " rows affected" << std::endl;
+            }
+            return true;
+        }
+        std::cout << "Error in reading results of Mysqle query" << std::endl;
         std::cout << "Error: " << mysql_error(m_db) << std::endl;
         return false;
     }
 
     num_fields = mysql_num_fields(result);
     fields = mysql_fetch_fields(result);
-    QString headers;
+    QList<QByteArray> headers;
     for (unsigned int i=0; i<num_fields; i++)
     {
-        if (i>0)
-            headers += ",";
-        headers += fields[i].name;
+        headers.append(QByteArray(fields[i].name, fields[i].name_length));
     }
-    oResult.push_back(headers);
+    iHandler.header(headers);
+
     while ((row = mysql_fetch_row(result)) != 0)
     {
-        QString row_s;
-        for (unsigned int i=0; i<num_fields; i++)
+        if (!iHandler.row(row, mysql_fetch_lengths(result), num_fields))
         {
-            if (i>0)
-                row_s += ",";
-            row_s += row[i];
+            break;
         }
-        oResult.push_back(row_s);
     }
 
+    bool ok = true;
+    if (mysql_errno(m_db) != 0)
+    {
+        std::cout << "Error in reading results of Mysqle query" << std::endl;
+        std::cout << "Error: " << mysql_error(m_db) << std::endl;
+        ok = false;
+    }
+    // Rows not read yet, if any, are discarded here
     mysql_free_result(result);
-    return true;
+    return ok;
+}
+
+bool AmarokCollection::handles(const QString &iFileName) const
+{
+    return FileStore::isMP3(iFileName);
+}
+
+// Every track under iDirectory is loaded in the snapshot, so that update() finds the tracks without a query
+StoreCursor* AmarokCollection::scan(const QString &iDirectory, bool iRecursive)
+{
+    if (!loadSnapshot(iDirectory))
+    {
+        return 0;
+    }
+    QMutexLocker locker(&m_mutex);
+    AmarokCursor* cursor = new AmarokCursor;
+    for (QHash<QString, AmarokTrack>::const_iterator i = m_snapshot.constBegin(); i != m_snapshot.constEnd(); ++i)
+    {
+        if (   i.value().rating <= 0
+            || (!iRecursive && i.key().indexOf('/', m_snapshotDirectory.length() + 1) >= 0))
+        {
+            continue;
+        }
+        KeyedEntry entry = { MetadataStore::sortKey(i.key()), StoreEntry(i.key()) };
+        entry.entry.hasRating = true;
+        entry.entry.rating = i.value().rating;
+        cursor->m_entries.append(entry);
+    }
+    qSort(cursor->m_entries);
+    return cursor;
+}
+
+bool AmarokCollection::update(const StoreEntry &iOld, const StoreEntry &iNew)
+{
+    Q_UNUSED(iOld);
+    QMutexLocker locker(&m_mutex);
+    attachThread();
+    bool urlPresent = false;
+    AmarokTrack track;
+    if (!lookupTrack(iNew.fileName, urlPresent, track))
+    {
+        return false;
+    }
+    if (!urlPresent)
+    {
+        std::cout << "  File is not in Amarok collection. Do nothing" << std::endl;
+        return true;
+    }
+    return queueTrack(iNew.fileName, track, (iNew.hasRating ? iNew.rating : 0));
 }
@@ -22,24 +22,119 @@
 
 #include <QtCore/QString>
 #include <QtCore/QMap>
+#include <QtCore/QHash>
 #include <QtCore/QList>
+#include <QtCore/QPair>
+#include <QtCore/QMutex>
+#include <QtCore/QStringList>
+
+#include <string>
+
+#include "MetadataStore.h"
 
 struct st_mysql;
 typedef struct st_mysql MYSQL;
+struct st_mysql_stmt;
+typedef struct st_mysql_stmt MYSQL_STMT;
+
+// One row of the Amarok collection: url, optional statistics row and rating
+struct AmarokTrack
+{
+    int urlId;
+    int statisticsId; // 0 if there is no statistics row for this url, -1 if created by a batched write
+    int rating;
+};
+
+// Receives the rows of a query one by one, as they are read from the database.
+// Rows are not buffered (mysql_use_result): the collection must not be queried again from these callbacks.
+class AmarokRowHandler
+{
+public:
+    virtual ~AmarokRowHandler() {}
+    // Column names, as bytes sent by the server (same encoding as the fields of rows)
+    virtual void header(const QList<QByteArray> &iColumns) { Q_UNUSED(iColumns); }
+    // iFields[i] is NULL for a NULL value. Return false to stop reading rows.
+    virtual bool row(const char* const* iFields, const unsigned long* iLengths, unsigned int iNbFields) = 0;
+};
+
+// Receives ratings of the collection one by one (same restriction as AmarokRowHandler)
+class AmarokRatingHandler
+{
+public:
+    virtual ~AmarokRatingHandler() {}
+    // Return false to stop reading ratings
+    virtual bool rating(const QString &iUrl, int iRating) = 0;
+};
 
-class AmarokCollection
+// Public methods may be called from several threads (neposync -j): they are serialized,
+// since the connection and its statements cannot be shared by concurrent queries.
+//
+// As a MetadataStore, the tracks under a directory are loaded at once in the snapshot, then their
+// ratings are sorted by key: the connection stays free for the changes written during a merge,
+// and these changes are queued without looking the tracks up again. Memory is thus proportional
+// to the number of tracks under the directory: the rows cannot be streamed in sort key order, as
+// SQL sorts rpath by its bytes and not by sort key.
+class AmarokCollection : public MetadataStore
 {
 protected:
     MYSQL* m_db;
+    QMutex m_mutex;
+    // Statements of the per-file hot path, prepared once per connection
+    MYSQL_STMT* m_lookupStmt;
+    MYSQL_STMT* m_insertStmt;
+    MYSQL_STMT* m_updateStmt;
+    bool prepareStatements();
+    MYSQL_STMT* prepareStatement(const char* iQuery);
+    // Mount point of each Amarok device (without trailing '/'), longest first.
+    // Urls are stored as (deviceid, rpath), so resolving paths on client side lets queries use urls index.
+    QList< QPair<int, QString> > m_devices;
+    bool loadDevices();
+    QList< QPair<int, QString> > splitUrl(const QString &iUrl) const;
+    std::string directoryCondition(const QString &iDirectory, bool iRecursive, QList<int> &oDeviceIds) const;
+    std::string pathExpression(const QList<int> &iDeviceIds) const;
+    std::string escape(const QString &iString) const;
+    bool streamQuery(const std::string &iQuery, AmarokRowHandler &iHandler);
+    // Snapshot of all tracks under m_snapshotDirectory, indexed by absolute path
+    bool m_hasSnapshot;
+    QString m_snapshotDirectory;
+    QHash<QString, AmarokTrack> m_snapshot;
+    bool inSnapshot(const QString &iUrl) const;
+    bool lookupTrack(QString iUrl, bool &oUrlPresent, AmarokTrack &oTrack);
+    // Write-behind rating changes (url id, rating), written by batches of m_batchSize rows
+    int m_batchSize;
+    QList< QPair<int, int> > m_pendingRatings;
+    // Ratings written since the last flush, and pending ratings of a failed batch
+    int m_nbWrittenRatings;
+    int m_nbRetriedRatings;
+    bool queueTrack(const QString &iUrl, AmarokTrack &ioTrack, int iRating);
+    bool writePendingRatings();
 public:
     bool m_isVerbose;
-    AmarokCollection(bool isVerbose) : m_isVerbose(isVerbose) {};
+    AmarokCollection(bool isVerbose) : m_db(0), m_lookupStmt(0), m_insertStmt(0), m_updateStmt(0), m_hasSnapshot(false), m_batchSize(500), m_nbWrittenRatings(0), m_nbRetriedRatings(0), m_isVerbose(isVerbose) {};
+    ~AmarokCollection();
     bool connect();
+    bool loadSnapshot(QString iDirectory);
+    // Later lookups query the database
+    void clearSnapshot();
+    QString devicePath(int iDeviceId, const char* iRpath) const;
     int getRating(QString url);
     bool getRating(QString iUrl, bool &oUrlPresent, int &oRating);
-    bool getAllRating(QString iUrl, QMap<QString, int> &oRatings);
+    bool getAllRating(QString iUrl, QMap<QString, int> &oRatings, bool iRecursive = true);
+    bool getAllRating(QString iUrl, AmarokRatingHandler &iHandler, bool iRecursive = true);
     bool setRating(QString iUrl, int iRating);
-    bool query(QString iQuery, QList<QString> &oResult);
+    void setBatchSize(int iBatchSize) { m_batchSize = iBatchSize; }
+    bool queueRating(QString iUrl, int iRating);
+    // Returns false if some ratings could not be written. Batches written before are kept (no transaction).
+    bool flushRatings();
+    bool query(QString iQuery, AmarokRowHandler &iHandler);
+    // MetadataStore
+    const char* storeName() const { return "Amarok"; }
+    // Only MP3 files are Amarok tracks: ratings of other files are neither copied nor cleared
+    bool handles(const QString &iFileName) const;
+    bool handlesTags(const QString &) const { return false; }
+    StoreCursor* scan(const QString &iDirectory, bool iRecursive);
+    bool update(const StoreEntry &iOld, const StoreEntry &iNew);
+    bool flush() { return flushRatings(); }
 };
 
 #endif // AMAROKCOLLECTION_H
@@ -0,0 +1,199 @@
+/*
+ * This file is part of Neposync program.
+ * Copyright (C) 2010 Eric Pignet <eric at erixpage dot com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "ApplyProcessor.h"
+
+#include <iostream>
+#include <sstream>
+
+#include "AmarokCollection.h"
+#include "FileStore.h"
+#include "ID3Utilities.h"
+#include "ImageMetadata.h"
+#include "NepomukCollection.h"
+
+QStringList ApplyProcessor::sortedTags(QStringList iTags)
+{
+    iTags.sort();
+    return iTags;
+}
+
+bool ApplyProcessor::check(FileReport &ioReport, const PlannedChange &iChange, const QVariant &iCurrentValue)
+{
+    bool isUnchanged = (iChange.oldValue.type() == QVariant::StringList)
+                       ? sortedTags(iCurrentValue.toStringList()) == sortedTags(iChange.oldValue.toStringList())
+                       : iCurrentValue == iChange.oldValue;
+    if (!isUnchanged)
+    {
+        ioReport.out() << "  Skipped " << PlannedChange::fieldName(iChange.field) << ": changed since the plan was made" << std::endl;
+        m_nbSkipped.ref();
+        return false;
+    }
+    if (m_isVerbose)
+    {
+        ioReport.out() << "  Changing " << PlannedChange::fieldName(iChange.field) << std::endl;
+    }
+    m_nbApplied.ref();
+    return true;
+}
+
+void ApplyProcessor::processFile(const QFileInfo &iFile)
+{
+    QHash<QString, QList<PlannedChange> >::const_iterator changes = m_changes.find(iFile.absoluteFilePath());
+    if (changes == m_changes.end())
+    {
+        return;
+    }
+    FileReport report(iFile.filePath(), m_isVerbose, m_isBuffered);
+    if (!iFile.isFile())
+    {
+        report.out() << "  File not found, its changes are skipped" << std::endl;
+        m_nbSkipped.fetchAndAddRelaxed(changes->size());
+        return;
+    }
+
+    // Each store is read once for all the changes of the file
+    ImageMetadata* image = 0;
+    ID3Session* id3 = 0;
+    std::ostringstream id3Output;
+    int newID3Rating = -1;
+    NepomukFile nepomukFile;
+    bool isNepomukRead = false;
+    NepomukChanges nepomukChanges;
+    foreach (const PlannedChange &change, *changes)
+    {
+        switch (change.field)
+        {
+        case PlannedChange::FileTags:
+        case PlannedChange::FileRating:
+            if (FileStore::isImage(iFile.fileName()))
+            {
+                if (!image)
+                {
+                    image = new ImageMetadata(iFile.filePath(), m_useSidecar);
+                }
+                if (change.field == PlannedChange::FileTags)
+                {
+                    QStringList keywords = image->keywords();
+                    if (check(report, change, keywords))
+                    {
+                        image->setKeywords(keywords, change.newValue.toStringList());
+                    }
+                }
+                else if (check(report, change, PlannedChange::ratingValue(image->rating())))
+                {
+                    image->setRating(change.newValue.isValid() ? QString::number(change.newValue.toInt()) : QString());
+                }
+            }
+            else if (FileStore::isMP3(iFile.fileName()) && change.field == PlannedChange::FileRating)
+            {
+                if (!id3)
+                {
+                    id3 = new ID3Session(iFile.filePath(), m_isVerbose, id3Output);
+                }
+                int rating = id3->rating();
+                report.append(id3Output);
+                if (check(report, change, rating))
+                {
+                    newID3Rating = change.newValue.toInt();
+                }
+            }
+            else
+            {
+                report.out() << "  Skipped " << PlannedChange::fieldName(change.field) << ": not supported by this file" << std::endl;
+                m_nbSkipped.ref();
+            }
+            break;
+        case PlannedChange::NepomukTags:
+        case PlannedChange::NepomukRating:
+            if (!isNepomukRead)
+            {
+                m_nepomuk->getFile(iFile.absoluteFilePath(), nepomukFile, false);
+                isNepomukRead = true;
+            }
+            if (change.field == PlannedChange::NepomukTags)
+            {
+                if (check(report, change, nepomukFile.tagLabels))
+                {
+                    QStringList newTags = change.newValue.toStringList();
+                    for (int i=0; i<nepomukFile.tagLabels.size(); ++i)
+                    {
+                        if (!newTags.contains(nepomukFile.tagLabels[i]))
+                        {
+                            nepomukChanges.removedTags.append(i);
+                        }
+                    }
+                    foreach (const QString &tag, newTags)
+                    {
+                        if (!nepomukFile.tagLabels.contains(tag))
+                        {
+                            nepomukChanges.addedTags.append(tag);
+                        }
+                    }
+                }
+            }
+            else if (check(report, change, nepomukFile.hasRating ? QVariant((int)nepomukFile.rating) : QVariant()))
+            {
+                nepomukChanges.isRatingRemoved = !change.newValue.isValid();
+                nepomukChanges.newRating = (change.newValue.isValid() ? change.newValue.toInt() : -1);
+            }
+            break;
+        case PlannedChange::AmarokRating:
+        {
+            bool urlPresent = false;
+            int amarokRating = 0;
+            m_amarokDb->getRating(iFile.absoluteFilePath(), urlPresent, amarokRating);
+            if (!urlPresent)
+            {
+                report.out() << "  Skipped " << PlannedChange::fieldName(change.field) << ": file is not in Amarok collection" << std::endl;
+                m_nbSkipped.ref();
+            }
+            else if (check(report, change, amarokRating) && !m_amarokDb->queueRating(iFile.absoluteFilePath(), change.newValue.toInt()))
+            {
+                report.out() << "  Cannot write Amarok rating" << std::endl;
+                m_nbApplied.deref();
+            }
+            break;
+        }
+        }
+    }
+
+    if (image && image->changeCount() > 0 && !image->commit())
+    {
+        report.out() << "  Cannot save file" << std::endl;
+    }
+    if (id3 && newID3Rating >= 0)
+    {
+        id3->setRating(newID3Rating);
+        report.append(id3Output);
+    }
+    m_nepomuk->queueChanges(nepomukFile, nepomukChanges);
+    delete image;
+    delete id3;
+}
+
+bool ApplyProcessor::flush()
+{
+    bool isWritten = m_nepomuk->flushChanges();
+    if (m_amarokDb)
+    {
+        isWritten = m_amarokDb->flushRatings() && isWritten;
+    }
+    return isWritten;
+}
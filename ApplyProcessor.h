@@ -0,0 +1,74 @@
+/*
+ * This file is part of Neposync program.
+ * Copyright (C) 2010 Eric Pignet <eric at erixpage dot com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef APPLYPROCESSOR_H
+#define APPLYPROCESSOR_H
+
+#include <QtCore/QAtomicInt>
+#include <QtCore/QFileInfo>
+#include <QtCore/QHash>
+#include <QtCore/QList>
+#include <QtCore/QString>
+#include <QtCore/QStringList>
+#include <QtCore/QVariant>
+
+#include "ChangePlan.h"
+#include "FileWalker.h"
+#include "SyncFile.h"
+
+class AmarokCollection;
+class NepomukCollection;
+
+// Makes the changes of a plan written by --plan (--apply), file by file. Called concurrently with -j.
+//
+// A field is changed only if it still has the value it had when the plan was made: otherwise it
+// was changed since, and its change is skipped. Files are written once for all their changes, and
+// stores by batches of files.
+class ApplyProcessor : public FileProcessor
+{
+public:
+    // iChanges are indexed by absolute path
+    ApplyProcessor(const QHash<QString, QList<PlannedChange> > &iChanges, bool iUseSidecar, bool isVerbose, bool isBuffered,
+                   NepomukCollection* iNepomuk, AmarokCollection* iAmarokDb = 0)
+        : m_changes(iChanges), m_useSidecar(iUseSidecar), m_isVerbose(isVerbose), m_isBuffered(isBuffered),
+          m_nepomuk(iNepomuk), m_amarokDb(iAmarokDb), m_nbApplied(0), m_nbSkipped(0) {}
+
+    void processFile(const QFileInfo &iFile);
+    // Writes the store changes still queued. Returns false if any could not be written.
+    bool flush();
+
+    int nbApplied() const { return m_nbApplied; }
+    int nbSkipped() const { return m_nbSkipped; }
+
+protected:
+    const QHash<QString, QList<PlannedChange> > &m_changes;
+    bool m_useSidecar;
+    bool m_isVerbose;
+    bool m_isBuffered;
+    NepomukCollection* m_nepomuk;
+    AmarokCollection* m_amarokDb;
+    QAtomicInt m_nbApplied;
+    QAtomicInt m_nbSkipped;
+
+    static QStringList sortedTags(QStringList iTags);
+    // Counts the change, and tells whether it is to be made
+    bool check(FileReport &ioReport, const PlannedChange &iChange, const QVariant &iCurrentValue);
+};
+
+#endif // APPLYPROCESSOR_H
@@ -0,0 +1,440 @@
+/*
+ * This file is part of Neposync program.
+ * Copyright (C) 2010 Eric Pignet <eric at erixpage dot com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "ChangePlan.h"
+
+#include <iostream>
+
+#include <QtCore/QByteArray>
+#include <QtCore/QMutexLocker>
+#include <QtCore/QStringList>
+
+static const char* const fieldNames[] = { "file.tags", "file.rating", "nepomuk.tags", "nepomuk.rating", "amarok.rating" };
+
+const char* PlannedChange::fieldName(Field iField)
+{
+    return fieldNames[iField];
+}
+
+bool PlannedChange::fieldFromName(const QString &iName, Field &oField)
+{
+    for (int i=0; i<(int)(sizeof(fieldNames) / sizeof(fieldNames[0])); i++)
+    {
+        if (iName == fieldNames[i])
+        {
+            oField = (Field)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+QVariant PlannedChange::ratingValue(const QString &iRating)
+{
+    return (iRating.isNull() ? QVariant() : QVariant(iRating.toInt()));
+}
+
+//------------------
+// Writer
+
+bool PlanWriter::write(const QList<PlannedChange> &iChanges)
+{
+    // Lines are built first, so that the lock is held for one write only
+    std::string lines;
+    foreach (const PlannedChange &change, iChanges)
+    {
+        lines += "{\"file\":";
+        writeString(change.fileName, lines);
+        lines += ",\"field\":\"";
+        lines += PlannedChange::fieldName(change.field);
+        lines += "\",\"old\":";
+        writeValue(change.oldValue, lines);
+        lines += ",\"new\":";
+        writeValue(change.newValue, lines);
+        lines += "}\n";
+    }
+    QMutexLocker locker(&m_mutex);
+    m_output << lines;
+    m_output.flush();
+    m_nbChanges += iChanges.size();
+    return m_output.good();
+}
+
+void PlanWriter::writeValue(const QVariant &iValue, std::string &ioLine)
+{
+    if (!iValue.isValid())
+    {
+        ioLine += "null";
+    }
+    else if (iValue.type() == QVariant::StringList)
+    {
+        ioLine += '[';
+        QStringList values = iValue.toStringList();
+        for (int i=0; i<values.size(); i++)
+        {
+            if (i>0)
+                ioLine += ',';
+            writeString(values[i], ioLine);
+        }
+        ioLine += ']';
+    }
+    else
+    {
+        ioLine += QByteArray::number(iValue.toInt()).constData();
+    }
+}
+
+void PlanWriter::writeString(const QString &iString, std::string &ioLine)
+{
+    static const char hexDigits[] = "0123456789abcdef";
+    QByteArray utf8(iString.toUtf8());
+    ioLine += '"';
+    for (int i=0; i<utf8.size(); i++)
+    {
+        unsigned char c = utf8[i];
+        switch (c)
+        {
+        case '"':  ioLine += "\\\""; break;
+        case '\\': ioLine += "\\\\"; break;
+        case '\n': ioLine += "\\n"; break;
+        case '\r': ioLine += "\\r"; break;
+        case '\t': ioLine += "\\t"; break;
+        default:
+            if (c < 0x20)
+            {
+                ioLine += "\\u00";
+                ioLine += hexDigits[c >> 4];
+                ioLine += hexDigits[c & 0xf];
+            }
+            else
+            {
+                ioLine += c;
+            }
+        }
+    }
+    ioLine += '"';
+}
+
+//------------------
+// Reader
+
+bool PlanReader::next(PlannedChange &oChange)
+{
+    while (!m_isError && std::getline(m_input, m_line))
+    {
+        m_lineNumber++;
+        m_position = 0;
+        skipSpaces();
+        if (m_position == m_line.size())
+        {
+            continue;
+        }
+        return parseLine(oChange);
+    }
+    return false;
+}
+
+bool PlanReader::parseLine(PlannedChange &oChange)
+{
+    bool hasFile = false;
+    bool hasField = false;
+    bool hasOld = false;
+    bool hasNew = false;
+    if (!expect('{'))
+    {
+        return false;
+    }
+    skipSpaces();
+    bool isEnd = (m_position < m_line.size() && m_line[m_position] == '}');
+    while (!isEnd)
+    {
+        QString key;
+        if (!parseString(key) || !expect(':'))
+        {
+            return false;
+        }
+        if (key == "file")
+        {
+            if (!parseString(oChange.fileName))
+            {
+                return false;
+            }
+            hasFile = true;
+        }
+        else if (key == "field")
+        {
+            QString name;
+            if (!parseString(name))
+            {
+                return false;
+            }
+            if (!PlannedChange::fieldFromName(name, oChange.field))
+            {
+                return error("unknown field");
+            }
+            hasField = true;
+        }
+        else if (key == "old")
+        {
+            if (!parseValue(oChange.oldValue))
+            {
+                return false;
+            }
+            hasOld = true;
+        }
+        else if (key == "new")
+        {
+            if (!parseValue(oChange.newValue))
+            {
+                return false;
+            }
+            hasNew = true;
+        }
+        else
+        {
+            QVariant ignored;
+            if (!parseValue(ignored))
+            {
+                return false;
+            }
+        }
+        skipSpaces();
+        if (m_position < m_line.size() && m_line[m_position] == ',')
+        {
+            m_position++;
+        }
+        else
+        {
+            isEnd = true;
+        }
+    }
+    if (!expect('}'))
+    {
+        return false;
+    }
+    skipSpaces();
+    if (m_position != m_line.size())
+    {
+        return error("unexpected characters after the change");
+    }
+    if (!hasFile || !hasField || !hasOld || !hasNew)
+    {
+        return error("file, field, old and new are all needed");
+    }
+
+    // Tags are lists, ratings are numbers or null
+    bool isTags = (oChange.field == PlannedChange::FileTags || oChange.field == PlannedChange::NepomukTags);
+    const QVariant* values[] = { &oChange.oldValue, &oChange.newValue };
+    for (int i=0; i<2; i++)
+    {
+        bool isValid = (isTags ? values[i]->type() == QVariant::StringList
+                               : (!values[i]->isValid() || values[i]->type() == QVariant::Int));
+        if (!isValid)
+        {
+            return error(isTags ? "tags must be a list of strings" : "a rating must be a number or null");
+        }
+    }
+    return true;
+}
+
+void PlanReader::skipSpaces()
+{
+    while (m_position < m_line.size() && (m_line[m_position] == ' ' || m_line[m_position] == '\t' || m_line[m_position] == '\r'))
+    {
+        m_position++;
+    }
+}
+
+bool PlanReader::expect(char iChar)
+{
+    skipSpaces();
+    if (m_position >= m_line.size() || m_line[m_position] != iChar)
+    {
+        std::string message("expected '");
+        message += iChar;
+        message += "'";
+        return error(message.c_str());
+    }
+    m_position++;
+    return true;
+}
+
+bool PlanReader::parseString(QString &oString)
+{
+    if (!expect('"'))
+    {
+        return false;
+    }
+    // Escaped characters are converted to UTF-8, then the whole string is decoded at once
+    QByteArray utf8;
+    while (m_position < m_line.size())
+    {
+        char c = m_line[m_position++];
+        if (c == '"')
+        {
+            oString = QString::fromUtf8(utf8.constData(), utf8.size());
+            return true;
+        }
+        if (c != '\\')
+        {
+            utf8 += c;
+            continue;
+        }
+        if (m_position >= m_line.size())
+        {
+            break;
+        }
+        c = m_line[m_position++];
+        switch (c)
+        {
+        case '"':  utf8 += '"'; break;
+        case '\\': utf8 += '\\'; break;
+        case '/':  utf8 += '/'; break;
+        case 'b':  utf8 += '\b'; break;
+        case 'f':  utf8 += '\f'; break;
+        case 'n':  utf8 += '\n'; break;
+        case 'r':  utf8 += '\r'; break;
+        case 't':  utf8 += '\t'; break;
+        case 'u':
+        {
+            ushort unit = 0;
+            if (!parseUnit(unit))
+            {
+                return false;
+            }
+            QString units(QChar(unit));
+            // A character outside the BMP is escaped as a surrogate pair, converted with both halves
+            if (units[0].isHighSurrogate() && m_line.compare(m_position, 2, "\\u") == 0)
+            {
+                m_position += 2;
+                if (!parseUnit(unit))
+                {
+                    return false;
+                }
+                units += QChar(unit);
+            }
+            utf8 += units.toUtf8();
+            break;
+        }
+        default:
+            return error("invalid escape");
+        }
+    }
+    return error("unterminated string");
+}
+
+// Four hexadecimal digits of a \u escape
+bool PlanReader::parseUnit(ushort &oUnit)
+{
+    bool ok = false;
+    if (m_position + 4 <= m_line.size())
+    {
+        oUnit = QByteArray(m_line.data() + m_position, 4).toUShort(&ok, 16);
+    }
+    if (!ok)
+    {
+        return error("invalid \\u escape");
+    }
+    m_position += 4;
+    return true;
+}
+
+bool PlanReader::parseValue(QVariant &oValue)
+{
+    skipSpaces();
+    if (m_position >= m_line.size())
+    {
+        return error("missing value");
+    }
+    char c = m_line[m_position];
+    if (c == '"')
+    {
+        QString value;
+        if (!parseString(value))
+        {
+            return false;
+        }
+        oValue = value;
+        return true;
+    }
+    if (c == '[')
+    {
+        m_position++;
+        QStringList values;
+        skipSpaces();
+        if (m_position < m_line.size() && m_line[m_position] == ']')
+        {
+            m_position++;
+            oValue = values;
+            return true;
+        }
+        for (;;)
+        {
+            QString value;
+            if (!parseString(value))
+            {
+                return false;
+            }
+            values.append(value);
+            skipSpaces();
+            if (m_position >= m_line.size() || m_line[m_position] != ',')
+            {
+                break;
+            }
+            m_position++;
+        }
+        if (!expect(']'))
+        {
+            return false;
+        }
+        oValue = values;
+        return true;
+    }
+    if (m_line.compare(m_position, 4, "null") == 0)
+    {
+        m_position += 4;
+        oValue = QVariant();
+        return true;
+    }
+    std::string::size_type end = m_position;
+    if (end < m_line.size() && m_line[end] == '-')
+    {
+        end++;
+    }
+    while (end < m_line.size() && m_line[end] >= '0' && m_line[end] <= '9')
+    {
+        end++;
+    }
+    bool ok = false;
+    int value = QByteArray(m_line.data() + m_position, end - m_position).toInt(&ok);
+    if (!ok)
+    {
+        return error("invalid value");
+    }
+    m_position = end;
+    oValue = value;
+    return true;
+}
+
+bool PlanReader::error(const char* iMessage)
+{
+    std::cout << "Error: invalid plan line " << m_lineNumber << ": " << iMessage << std::endl;
+    m_isError = true;
+    return false;
+}
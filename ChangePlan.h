@@ -0,0 +1,92 @@
+/*
+ * This file is part of Neposync program.
+ * Copyright (C) 2010 Eric Pignet <eric at erixpage dot com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef CHANGEPLAN_H
+#define CHANGEPLAN_H
+
+#include <istream>
+#include <ostream>
+#include <string>
+
+#include <QtCore/QList>
+#include <QtCore/QMutex>
+#include <QtCore/QString>
+#include <QtCore/QVariant>
+
+// One change found by neposync --plan: a field of a file in a store, with its value when the plan
+// was made and the value to write. Tags are string lists, ratings are integers, or null for no rating.
+struct PlannedChange
+{
+    enum Field { FileTags, FileRating, NepomukTags, NepomukRating, AmarokRating };
+    // Absolute path
+    QString fileName;
+    Field field;
+    QVariant oldValue;
+    QVariant newValue;
+
+    PlannedChange() : field(FileTags) {}
+    // Field names in plans: "file.tags", "file.rating", "nepomuk.tags", "nepomuk.rating", "amarok.rating"
+    static const char* fieldName(Field iField);
+    static bool fieldFromName(const QString &iName, Field &oField);
+    // Image rating, as read from the file, as a value: null if none
+    static QVariant ratingValue(const QString &iRating);
+};
+
+// Writes a plan as JSON lines, one change per line, the changes of a file being written together:
+//   {"file":"/photos/a.jpg","field":"file.tags","old":["sea"],"new":["sea","sun"]}
+// Strings are written in UTF-8. May be used from several threads.
+class PlanWriter
+{
+public:
+    PlanWriter(std::ostream &iOutput) : m_output(iOutput), m_nbChanges(0) {}
+    bool write(const QList<PlannedChange> &iChanges);
+    int nbChanges() const { return m_nbChanges; }
+protected:
+    std::ostream &m_output;
+    QMutex m_mutex;
+    int m_nbChanges;
+    static void writeValue(const QVariant &iValue, std::string &ioLine);
+    static void writeString(const QString &iString, std::string &ioLine);
+};
+
+// Reads a plan written by PlanWriter. Empty lines are skipped, and so are unknown keys.
+class PlanReader
+{
+public:
+    PlanReader(std::istream &iInput) : m_input(iInput), m_lineNumber(0), m_isError(false), m_position(0) {}
+    // Returns false at the end of the plan, or at an invalid line (isError() is then true)
+    bool next(PlannedChange &oChange);
+    bool isError() const { return m_isError; }
+protected:
+    std::istream &m_input;
+    int m_lineNumber;
+    bool m_isError;
+    // Line being parsed
+    std::string m_line;
+    std::string::size_type m_position;
+    bool parseLine(PlannedChange &oChange);
+    void skipSpaces();
+    bool expect(char iChar);
+    bool parseString(QString &oString);
+    bool parseUnit(ushort &oUnit);
+    bool parseValue(QVariant &oValue);
+    bool error(const char* iMessage);
+};
+
+#endif // CHANGEPLAN_H
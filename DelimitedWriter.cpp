@@ -0,0 +1,99 @@
+/*
+ * This file is part of Neposync program.
+ * Copyright (C) 2010 Eric Pignet <eric at erixpage dot com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+
+#include "DelimitedWriter.h"
+
+#include <cstddef>
+
+void DelimitedWriter::header(const QList<QByteArray> &iColumns)
+{
+    for (int i=0; i<iColumns.size(); i++)
+    {
+        if (i>0)
+            m_output << (m_format == TSV ? '\t' : ',');
+        writeField(iColumns[i].constData(), iColumns[i].length());
+    }
+    m_output << '\n';
+}
+
+bool DelimitedWriter::row(const char* const* iFields, const unsigned long* iLengths, unsigned int iNbFields)
+{
+    for (unsigned int i=0; i<iNbFields; i++)
+    {
+        if (i>0)
+            m_output << (m_format == TSV ? '\t' : ',');
+        writeField(iFields[i], iLengths[i]);
+    }
+    m_output << '\n';
+    return m_output.good();
+}
+
+void DelimitedWriter::writeField(const char* iField, unsigned long iLength)
+{
+    if (m_format == Plain)
+    {
+        // As neposync always did: fields are written as is, so a field may contain commas or newlines
+        if (iField != NULL)
+            m_output.write(iField, iLength);
+    }
+    else if (m_format == CSV)
+    {
+        // NULL and empty values are both written as an empty field
+        if (iField == NULL)
+            return;
+        bool needsQuotes = false;
+        for (unsigned long i=0; i<iLength && !needsQuotes; i++)
+        {
+            needsQuotes = (iField[i] == ',' || iField[i] == '"' || iField[i] == '\n' || iField[i] == '\r');
+        }
+        if (!needsQuotes)
+        {
+            m_output.write(iField, iLength);
+            return;
+        }
+        m_output << '"';
+        for (unsigned long i=0; i<iLength; i++)
+        {
+            if (iField[i] == '"')
+                m_output << '"';
+            m_output << iField[i];
+        }
+        m_output << '"';
+    }
+    else
+    {
+        if (iField == NULL)
+        {
+            m_output << "\\N";
+            return;
+        }
+        for (unsigned long i=0; i<iLength; i++)
+        {
+            switch (iField[i])
+            {
+            case '\t': m_output << "\\t"; break;
+            case '\n': m_output << "\\n"; break;
+            case '\r': m_output << "\\r"; break;
+            case '\\': m_output << "\\\\"; break;
+            default: m_output << iField[i];
+            }
+        }
+    }
+}
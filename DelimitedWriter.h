@@ -0,0 +1,44 @@
+/*
+ * This file is part of Neposync program.
+ * Copyright (C) 2010 Eric Pignet <eric at erixpage dot com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+
+#ifndef DELIMITEDWRITER_H
+#define DELIMITEDWRITER_H
+
+#include <ostream>
+
+#include "AmarokCollection.h"
+
+// Writes query rows as they arrive, either as plain comma-separated values (no quoting, NULL written as
+// an empty field), as CSV (RFC 4180 quoting) or as TSV (tab, newline, carriage return and backslash
+// escaped with a backslash, NULL written as \N). Bytes are written as sent by the server.
+class DelimitedWriter : public AmarokRowHandler
+{
+public:
+    enum Format { Plain, CSV, TSV };
+    DelimitedWriter(std::ostream &iOutput, Format iFormat = Plain) : m_output(iOutput), m_format(iFormat) {};
+    void header(const QList<QByteArray> &iColumns);
+    bool row(const char* const* iFields, const unsigned long* iLengths, unsigned int iNbFields);
+protected:
+    std::ostream &m_output;
+    Format m_format;
+    void writeField(const char* iField, unsigned long iLength);
+};
+
+#endif // DELIMITEDWRITER_H
@@ -0,0 +1,236 @@
+/*
+ * This file is part of Neposync program.
+ * Copyright (C) 2010 Eric Pignet <eric at erixpage dot com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "DirectoryWatcher.h"
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include <QtCore/QDir>
+#include <QtCore/QDirIterator>
+#include <QtCore/QFile>
+
+// Files written, files or directories moved in, directories created
+static const uint32_t watchMask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE;
+
+// Nothing to do in the handler: the signal only interrupts ppoll()
+static void interruptHandler(int)
+{
+}
+
+DirectoryWatcher::DirectoryWatcher(const QString &iDirectory, bool iRecursive, bool isVerbose)
+    : m_directory(iDirectory), m_recursive(iRecursive), m_isVerbose(isVerbose), m_fd(-1), m_isMaskSet(false)
+{
+}
+
+DirectoryWatcher::~DirectoryWatcher()
+{
+    if (m_fd >= 0)
+    {
+        close(m_fd);
+    }
+    if (m_isMaskSet)
+    {
+        sigprocmask(SIG_SETMASK, &m_previousMask, 0);
+    }
+}
+
+bool DirectoryWatcher::start()
+{
+    m_fd = inotify_init();
+    if (m_fd < 0)
+    {
+        std::cout << "Error: cannot initialize inotify: " << strerror(errno) << std::endl;
+        return false;
+    }
+    if (!addDirectory(m_directory, 0))
+    {
+        return false;
+    }
+    if (m_isVerbose)
+    {
+        std::cout << "Watching " << m_directories.size() << " directories" << std::endl;
+    }
+    return true;
+}
+
+// Watches iDirectory (and its subdirectories if recursive), and lists the files already there in oFiles, if given
+bool DirectoryWatcher::addDirectory(const QString &iDirectory, QStringList *oFiles)
+{
+    QStringList directories(iDirectory);
+    if (m_recursive)
+    {
+        QDirIterator it(iDirectory, QDir::Dirs | QDir::NoDotAndDotDot | QDir::NoSymLinks, QDirIterator::Subdirectories);
+        while (it.hasNext())
+        {
+            directories.append(it.next());
+        }
+    }
+
+    foreach (const QString &directory, directories)
+    {
+        int wd = inotify_add_watch(m_fd, QFile::encodeName(directory).constData(), watchMask);
+        if (wd < 0)
+        {
+            std::cout << "Error: cannot watch " << std::string(directory.toLocal8Bit()) << ": " << strerror(errno) << std::endl;
+            if (errno == ENOSPC)
+            {
+                std::cout << "  (see /proc/sys/fs/inotify/max_user_watches)" << std::endl;
+            }
+            return false;
+        }
+        m_directories.insert(wd, directory);
+        if (oFiles)
+        {
+            foreach (const QString &file, QDir(directory).entryList(QDir::Files | QDir::NoDotAndDotDot))
+            {
+                oFiles->append(directory + "/" + file);
+            }
+        }
+    }
+    return true;
+}
+
+void DirectoryWatcher::addFile(const QString &iFile, QStringList &ioFiles, QSet<QString> &ioKnownFiles)
+{
+    if (!ioKnownFiles.contains(iFile))
+    {
+        ioKnownFiles.insert(iFile);
+        ioFiles.append(iFile);
+    }
+}
+
+bool DirectoryWatcher::readEvents(QStringList &ioFiles, QSet<QString> &ioKnownFiles, bool &oRescan)
+{
+    char buffer[65536] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    ssize_t length = read(m_fd, buffer, sizeof(buffer));
+    if (length <= 0)
+    {
+        return errno == EINTR || errno == EAGAIN;
+    }
+
+    for (char* position = buffer; position < buffer + length; )
+    {
+        const struct inotify_event* event = reinterpret_cast<const struct inotify_event*>(position);
+        position += sizeof(struct inotify_event) + event->len;
+
+        if (event->mask & IN_Q_OVERFLOW)
+        {
+            oRescan = true;
+            continue;
+        }
+        if (event->mask & IN_IGNORED)
+        {
+            // Directory removed or moved away
+            m_directories.remove(event->wd);
+            continue;
+        }
+        QHash<int, QString>::const_iterator directory = m_directories.constFind(event->wd);
+        if (directory == m_directories.constEnd() || event->len == 0 || event->name[0] == '.')
+        {
+            continue;
+        }
+        QString path = directory.value() + "/" + QFile::decodeName(event->name);
+
+        if (event->mask & IN_ISDIR)
+        {
+            if (m_recursive && (event->mask & (IN_CREATE | IN_MOVED_TO)))
+            {
+                QStringList files;
+                addDirectory(path, &files);
+                foreach (const QString &file, files)
+                {
+                    addFile(file, ioFiles, ioKnownFiles);
+                }
+            }
+        }
+        else if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+        {
+            addFile(path, ioFiles, ioKnownFiles);
+        }
+    }
+    return true;
+}
+
+bool DirectoryWatcher::waitForChanges(QStringList &oFiles, bool &oRescan, int iDebounceMs)
+{
+    oFiles.clear();
+    oRescan = false;
+    QSet<QString> knownFiles;
+
+    if (!m_isMaskSet)
+    {
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = interruptHandler;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGINT, &action, 0);
+        sigaction(SIGTERM, &action, 0);
+        sigset_t interruptions;
+        sigemptyset(&interruptions);
+        sigaddset(&interruptions, SIGINT);
+        sigaddset(&interruptions, SIGTERM);
+        sigprocmask(SIG_BLOCK, &interruptions, &m_previousMask);
+        m_isMaskSet = true;
+    }
+
+    struct pollfd descriptor;
+    descriptor.fd = m_fd;
+    descriptor.events = POLLIN;
+
+    // Wait for a first event, then for a quiet period
+    bool hasEvents = false;
+    forever
+    {
+        struct timespec timeout;
+        timeout.tv_sec = iDebounceMs / 1000;
+        timeout.tv_nsec = (iDebounceMs % 1000) * 1000000L;
+        int result = ppoll(&descriptor, 1, (hasEvents ? &timeout : 0), &m_previousMask);
+        if (result < 0)
+        {
+            if (errno == EINTR)
+            {
+                // Interrupted: the program is stopping, changes not yet returned are left to the next run
+                return false;
+            }
+            std::cout << "Error: cannot wait for changes: " << strerror(errno) << std::endl;
+            return false;
+        }
+        if (result == 0)
+        {
+            // Quiet period: changes are complete
+            if (!oFiles.isEmpty() || oRescan)
+            {
+                return true;
+            }
+            hasEvents = false;
+            continue;
+        }
+        if (!readEvents(oFiles, knownFiles, oRescan))
+        {
+            std::cout << "Error: cannot read changes: " << strerror(errno) << std::endl;
+            return false;
+        }
+        hasEvents = true;
+    }
+}
@@ -0,0 +1,64 @@
+/*
+ * This file is part of Neposync program.
+ * Copyright (C) 2010 Eric Pignet <eric at erixpage dot com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef DIRECTORYWATCHER_H
+#define DIRECTORYWATCHER_H
+
+#include <QtCore/QHash>
+#include <QtCore/QSet>
+#include <QtCore/QString>
+#include <QtCore/QStringList>
+
+#include <signal.h>
+
+// Files written or moved into a directory tree, reported by inotify (Linux only).
+// Directories created or moved into the tree are watched as well, and their files reported.
+// Hidden files and directories are ignored, as by FileWalker.
+//
+// Events are queued from start() on. From the first waitForChanges() on, SIGINT and SIGTERM are
+// only received while waiting for changes: an interruption never stops the processing of the
+// changes already returned.
+class DirectoryWatcher
+{
+public:
+    DirectoryWatcher(const QString &iDirectory, bool iRecursive, bool isVerbose = false);
+    ~DirectoryWatcher();
+    bool start();
+    // Waits for changes, and returns them once no event came for iDebounceMs milliseconds.
+    // oRescan is set if events were lost, so that the whole tree must be synchronized again.
+    // Returns false when interrupted by SIGINT or SIGTERM.
+    bool waitForChanges(QStringList &oFiles, bool &oRescan, int iDebounceMs);
+protected:
+    QString m_directory;
+    bool m_recursive;
+    bool m_isVerbose;
+    int m_fd;
+    // Watched directories, by watch descriptor
+    QHash<int, QString> m_directories;
+    sigset_t m_previousMask;
+    bool m_isMaskSet;
+    bool addDirectory(const QString &iDirectory, QStringList *oFiles);
+    bool readEvents(QStringList &ioFiles, QSet<QString> &ioKnownFiles, bool &oRescan);
+    void addFile(const QString &iFile, QStringList &ioFiles, QSet<QString> &ioKnownFiles);
+private:
+    DirectoryWatcher(const DirectoryWatcher&);
+    DirectoryWatcher& operator=(const DirectoryWatcher&);
+};
+
+#endif // DIRECTORYWATCHER_H
@@ -0,0 +1,147 @@
+/*
+ * This file is part of Neposync program.
+ * Copyright (C) 2010 Eric Pignet <eric at erixpage dot com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "FileList.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <unistd.h>
+
+#include <QtCore/QFile>
+#include <QtCore/QFileInfo>
+
+// Read size: read() returns what is available, so that paths are handled as soon as they are written
+static const int readSize = 65536;
+
+FileList::FileList(const QString &iFileName, const QString &iDirectory, bool isVerbose)
+    : m_fileName(iFileName), m_directory(iDirectory), m_isVerbose(isVerbose), m_fd(-1), m_isEnd(false),
+      m_separator(0), m_position(0), m_nbSkipped(0)
+{
+}
+
+FileList::~FileList()
+{
+    if (m_fd >= 0 && m_fd != STDIN_FILENO)
+    {
+        close(m_fd);
+    }
+}
+
+bool FileList::open()
+{
+    if (m_fileName == "-")
+    {
+        m_fd = STDIN_FILENO;
+        return true;
+    }
+    m_fd = ::open(QFile::encodeName(m_fileName).constData(), O_RDONLY);
+    if (m_fd < 0)
+    {
+        std::cout << "Error: cannot open " << std::string(m_fileName.toLocal8Bit()) << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Appends available data to the buffer. Returns false at the end of the input.
+bool FileList::fill()
+{
+    // Drop the paths already read
+    m_buffer.remove(0, m_position);
+    m_position = 0;
+
+    int size = m_buffer.size();
+    m_buffer.resize(size + readSize);
+    ssize_t length;
+    do
+    {
+        length = read(m_fd, m_buffer.data() + size, readSize);
+    }
+    while (length < 0 && errno == EINTR);
+    if (length < 0)
+    {
+        std::cout << "Error: cannot read " << std::string(m_fileName.toLocal8Bit()) << ": " << strerror(errno) << std::endl;
+    }
+    m_buffer.resize(size + qMax(length, (ssize_t)0));
+    return length > 0;
+}
+
+bool FileList::readPath(QByteArray &oPath)
+{
+    forever
+    {
+        if (m_separator == 0)
+        {
+            for (int i=m_position; i<m_buffer.size(); ++i)
+            {
+                if (m_buffer[i] == '\0' || m_buffer[i] == '\n')
+                {
+                    m_separator = m_buffer[i];
+                    break;
+                }
+            }
+        }
+        int end = (m_separator == 0 ? -1 : m_buffer.indexOf(m_separator, m_position));
+        if (end >= 0)
+        {
+            oPath = m_buffer.mid(m_position, end - m_position);
+            m_position = end + 1;
+            return true;
+        }
+        if (m_isEnd || !fill())
+        {
+            // Last path, without a final separator
+            m_isEnd = true;
+            oPath = m_buffer.mid(m_position);
+            m_position = m_buffer.size();
+            return !oPath.isEmpty();
+        }
+    }
+}
+
+bool FileList::next(QString &oFile)
+{
+    QByteArray path;
+    while (readPath(path))
+    {
+        if (path.isEmpty())
+        {
+            continue;
+        }
+        QString file = QFile::decodeName(path);
+        if (file[0] != '/')
+        {
+            file = m_directory + "/" + file;
+        }
+        if (!QFileInfo(file).isFile())
+        {
+            m_nbSkipped++;
+            if (m_isVerbose)
+            {
+                std::cout << "Skipped (not a file): " << std::string(file.toLocal8Bit()) << std::endl;
+            }
+            continue;
+        }
+        oFile = file;
+        return true;
+    }
+    return false;
+}
@@ -0,0 +1,60 @@
+/*
+ * This file is part of Neposync program.
+ * Copyright (C) 2010 Eric Pignet <eric at erixpage dot com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef FILELIST_H
+#define FILELIST_H
+
+#include <QtCore/QByteArray>
+#include <QtCore/QString>
+
+// List of files to synchronize read from a file or from the standard input (--files-from), as it is
+// written: files are processed while the list is still being produced.
+//
+// Paths are separated by newlines, or by NUL characters (as printed by find -print0): the first
+// separator found decides. Relative paths are relative to the synchronized directory.
+// Paths which are not regular files (removed since, directories) are skipped.
+class FileList
+{
+public:
+    // iFileName is "-" for the standard input
+    FileList(const QString &iFileName, const QString &iDirectory, bool isVerbose = false);
+    ~FileList();
+    bool open();
+    // Returns false at the end of the list. Not thread-safe.
+    bool next(QString &oFile);
+    int nbSkipped() const { return m_nbSkipped; }
+protected:
+    QString m_fileName;
+    QString m_directory;
+    bool m_isVerbose;
+    int m_fd;
+    bool m_isEnd;
+    // Separator, 0 until the first one is found
+    char m_separator;
+    QByteArray m_buffer;
+    int m_position;
+    int m_nbSkipped;
+    bool readPath(QByteArray &oPath);
+    bool fill();
+private:
+    FileList(const FileList&);
+    FileList& operator=(const FileList&);
+};
+
+#endif // FILELIST_H
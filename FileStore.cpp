@@ -0,0 +1,166 @@
+/*
+ * This file is part of Neposync program.
+ * Copyright (C) 2010 Eric Pignet <eric at erixpage dot com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "FileStore.h"
+
+#include <QtCore/QDir>
+#include <QtCore/QFileInfo>
+#include <QtCore/QList>
+#include <QtCore/QtAlgorithms>
+
+#include "ID3Utilities.h"
+#include "ImageMetadata.h"
+
+// A file or directory of the walk, with its key. A directory key ends with '/', so that the
+// files under it come right after it, before its next sibling.
+struct WalkEntry
+{
+    QByteArray key;
+    QFileInfo info;
+    bool operator<(const WalkEntry &iOther) const { return qstrcmp(key, iOther.key) < 0; }
+};
+
+// Depth-first walk, each directory being listed and sorted when entered. Only the directories
+// being walked are in memory.
+class FileCursor : public StoreCursor
+{
+public:
+    FileCursor(const FileStore &iStore, const QString &iDirectory, bool iRecursive)
+        : m_store(iStore), m_recursive(iRecursive)
+    {
+        enter(QFileInfo(iDirectory));
+    }
+    bool next(StoreEntry &oEntry)
+    {
+        while (!m_stack.isEmpty())
+        {
+            QList<WalkEntry> &entries = m_stack.last();
+            if (entries.isEmpty())
+            {
+                m_stack.removeLast();
+                continue;
+            }
+            QFileInfo file = entries.takeFirst().info;
+            if (file.isDir())
+            {
+                enter(file);
+            }
+            else if (m_store.read(file.absoluteFilePath(), oEntry))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+private:
+    const FileStore &m_store;
+    bool m_recursive;
+    QList< QList<WalkEntry> > m_stack;
+    void enter(const QFileInfo &iDirectory)
+    {
+        QDir dir(iDirectory.absoluteFilePath());
+        QList<WalkEntry> entries;
+        // Same entries as FileWalker: hidden files and symlinked directories are skipped
+        foreach (const QFileInfo &file, dir.entryInfoList(QDir::Files | QDir::NoDotAndDotDot))
+        {
+            if (FileStore::isImage(file.fileName()) || FileStore::isMP3(file.fileName()))
+            {
+                WalkEntry entry = { MetadataStore::sortKey(file.absoluteFilePath()), file };
+                entries.append(entry);
+            }
+        }
+        if (m_recursive)
+        {
+            foreach (const QFileInfo &subDir, dir.entryInfoList(QDir::Dirs | QDir::NoDotAndDotDot | QDir::NoSymLinks))
+            {
+                WalkEntry entry = { MetadataStore::sortKey(subDir.absoluteFilePath()) + '/', subDir };
+                entries.append(entry);
+            }
+        }
+        qSort(entries);
+        m_stack.append(entries);
+    }
+};
+
+bool FileStore::isImage(const QString &iFileName)
+{
+    QString suffix = QFileInfo(iFileName).suffix();
+    return    !suffix.compare("jpg", Qt::CaseInsensitive)
+           || !suffix.compare("jpeg", Qt::CaseInsensitive);
+}
+
+bool FileStore::isMP3(const QString &iFileName)
+{
+    return !QFileInfo(iFileName).suffix().compare("mp3", Qt::CaseInsensitive);
+}
+
+bool FileStore::handles(const QString &iFileName) const
+{
+    return (isImage(iFileName) || isMP3(iFileName)) && QFileInfo(iFileName).isFile();
+}
+
+StoreCursor* FileStore::scan(const QString &iDirectory, bool iRecursive)
+{
+    return new FileCursor(*this, iDirectory, iRecursive);
+}
+
+bool FileStore::read(const QString &iFileName, StoreEntry &oEntry) const
+{
+    oEntry = StoreEntry(iFileName);
+    if (isImage(iFileName))
+    {
+        ImageMetadata image(iFileName, m_useSidecar);
+        oEntry.tags = image.keywords();
+        QString rating = image.rating();
+        oEntry.hasRating = !rating.isNull();
+        oEntry.rating = rating.toInt();
+    }
+    else if (isMP3(iFileName))
+    {
+        // An MP3 file without rating has rating 0
+        ID3Session id3(iFileName, m_isVerbose);
+        oEntry.rating = id3.rating();
+        oEntry.hasRating = (oEntry.rating > 0);
+    }
+    return !oEntry.tags.isEmpty() || oEntry.hasRating;
+}
+
+bool FileStore::update(const StoreEntry &iOld, const StoreEntry &iNew)
+{
+    if (isImage(iNew.fileName))
+    {
+        // Tags and rating are written at once
+        ImageMetadata image(iNew.fileName, m_useSidecar);
+        if (iNew.tags != iOld.tags)
+        {
+            image.setKeywords(image.keywords(), iNew.tags);
+        }
+        if (iNew.hasRating != iOld.hasRating || iNew.rating != iOld.rating)
+        {
+            image.setRating(iNew.hasRating ? QString::number(iNew.rating) : QString());
+        }
+        return image.commit();
+    }
+    if (isMP3(iNew.fileName))
+    {
+        ID3Session id3(iNew.fileName, m_isVerbose);
+        return id3.setRating(iNew.hasRating ? iNew.rating : 0);
+    }
+    return false;
+}
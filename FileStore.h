@@ -0,0 +1,48 @@
+/*
+ * This file is part of Neposync program.
+ * Copyright (C) 2010 Eric Pignet <eric at erixpage dot com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef FILESTORE_H
+#define FILESTORE_H
+
+#include "MetadataStore.h"
+
+// Tags and ratings kept in the files themselves: IPTC keywords and XMP rating of JPEG images (or of
+// their XMP sidecar, with iUseSidecar), POPM rating of MP3 files. A scan walks the directory in key
+// order and reads every image and MP3 file, listing those with tags or rating.
+// Changes are written at once.
+class FileStore : public MetadataStore
+{
+public:
+    FileStore(bool iUseSidecar = false, bool isVerbose = false) : m_useSidecar(iUseSidecar), m_isVerbose(isVerbose) {}
+    const char* storeName() const { return "files"; }
+    bool handles(const QString &iFileName) const;
+    bool handlesTags(const QString &iFileName) const { return isImage(iFileName); }
+    StoreCursor* scan(const QString &iDirectory, bool iRecursive);
+    bool update(const StoreEntry &iOld, const StoreEntry &iNew);
+    bool flush() { return true; }
+    // Returns false if the file has no tags and no rating
+    bool read(const QString &iFileName, StoreEntry &oEntry) const;
+    static bool isImage(const QString &iFileName);
+    static bool isMP3(const QString &iFileName);
+protected:
+    bool m_useSidecar;
+    bool m_isVerbose;
+};
+
+#endif // FILESTORE_H
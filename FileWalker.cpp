@@ -0,0 +1,306 @@
+/*
+ * This file is part of Neposync program.
+ * Copyright (C) 2010 Eric Pignet <eric at erixpage dot com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "FileWalker.h"
+#include "FileList.h"
+
+#include <QtCore/QAtomicInt>
+#include <QtCore/QDir>
+#include <QtCore/QDirIterator>
+#include <QtCore/QList>
+#include <QtCore/QMutex>
+#include <QtCore/QMutexLocker>
+#include <QtCore/QThread>
+#include <QtCore/QVector>
+#include <QtCore/QWaitCondition>
+
+namespace
+{
+
+// A directory to list or a file to process
+struct WalkItem
+{
+    QFileInfo info;
+    bool isDirectory;
+};
+
+// Queue of one worker: the owner takes the newest entries, thieves take the oldest
+class WorkQueue
+{
+public:
+    void push(const WalkItem &iItem)
+    {
+        QMutexLocker locker(&m_mutex);
+        m_items.append(iItem);
+    }
+    bool pop(WalkItem &oItem)
+    {
+        QMutexLocker locker(&m_mutex);
+        if (m_items.isEmpty())
+            return false;
+        oItem = m_items.takeLast();
+        return true;
+    }
+    bool steal(WalkItem &oItem)
+    {
+        QMutexLocker locker(&m_mutex);
+        if (m_items.isEmpty())
+            return false;
+        oItem = m_items.takeFirst();
+        return true;
+    }
+private:
+    QMutex m_mutex;
+    QList<WalkItem> m_items;
+};
+
+class WalkerPool
+{
+public:
+    WalkerPool(int iNbWorkers, bool iRecursive, FileProcessor &iProcessor, int iMaxPending = 0)
+        : m_queues(iNbWorkers), m_recursive(iRecursive), m_processor(iProcessor), m_pending(0), m_maxPending(iMaxPending)
+    {
+        for (int i=0; i<iNbWorkers; ++i)
+            m_queues[i] = new WorkQueue();
+    }
+    ~WalkerPool()
+    {
+        qDeleteAll(m_queues);
+    }
+
+    // Items are counted as pending before being queued, and until they are processed,
+    // so that no worker leaves while another one may still queue new entries
+    void push(int iWorker, const WalkItem &iItem)
+    {
+        m_pending.ref();
+        m_queues[iWorker]->push(iItem);
+        QMutexLocker locker(&m_idleMutex);
+        m_idle.wakeOne();
+    }
+
+    // Keeps the workers waiting for entries until release(), while the caller still has entries to queue
+    void hold()
+    {
+        m_pending.ref();
+    }
+    void release()
+    {
+        done();
+    }
+
+    // Waits until less than the maximum of items are pending, so that a list read faster than
+    // it is processed is not loaded in memory
+    void waitForRoom()
+    {
+        QMutexLocker locker(&m_idleMutex);
+        while (m_pending >= m_maxPending)
+        {
+            m_room.wait(&m_idleMutex);
+        }
+    }
+
+    void work(int iWorker)
+    {
+        WalkItem item;
+        while (next(iWorker, item))
+        {
+            if (item.isDirectory)
+                list(iWorker, item.info.filePath());
+            else
+                m_processor.processFile(item.info);
+            done();
+        }
+    }
+
+protected:
+    QVector<WorkQueue*> m_queues;
+    bool m_recursive;
+    FileProcessor &m_processor;
+    QAtomicInt m_pending;
+    QMutex m_idleMutex;
+    QWaitCondition m_idle;
+    QWaitCondition m_room;
+    const int m_maxPending;
+
+    void done()
+    {
+        int pending = m_pending.fetchAndAddOrdered(-1) - 1;
+        if (pending == 0)
+        {
+            QMutexLocker locker(&m_idleMutex);
+            m_idle.wakeAll();
+        }
+        else if (m_maxPending > 0 && pending == m_maxPending - 1)
+        {
+            QMutexLocker locker(&m_idleMutex);
+            m_room.wakeOne();
+        }
+    }
+
+    // Same entries as QDirIterator(QDir::Files | QDir::NoDotAndDotDot), which skips hidden and symlinked directories
+    void list(int iWorker, const QString &iDirectory)
+    {
+        QDir dir(iDirectory);
+        if (m_recursive)
+        {
+            foreach (const QFileInfo &subDir, dir.entryInfoList(QDir::Dirs | QDir::NoDotAndDotDot | QDir::NoSymLinks))
+            {
+                WalkItem item = { subDir, true };
+                push(iWorker, item);
+            }
+        }
+        foreach (const QFileInfo &file, dir.entryInfoList(QDir::Files | QDir::NoDotAndDotDot))
+        {
+            WalkItem item = { file, false };
+            push(iWorker, item);
+        }
+    }
+
+    bool next(int iWorker, WalkItem &oItem)
+    {
+        forever
+        {
+            if (m_queues[iWorker]->pop(oItem))
+                return true;
+            for (int i=1; i<m_queues.size(); ++i)
+            {
+                if (m_queues[(iWorker + i) % m_queues.size()]->steal(oItem))
+                    return true;
+            }
+            QMutexLocker locker(&m_idleMutex);
+            if (m_pending == 0)
+                return false;
+            // The timeout covers entries queued between the steal attempts and the wait
+            m_idle.wait(&m_idleMutex, 20);
+        }
+    }
+};
+
+class WalkerThread : public QThread
+{
+public:
+    WalkerThread(WalkerPool &iPool, int iIndex) : m_pool(iPool), m_index(iIndex) {}
+protected:
+    void run() { m_pool.work(m_index); }
+private:
+    WalkerPool &m_pool;
+    int m_index;
+};
+
+}
+
+// Files of a list queued per job ahead of processing
+static const int listedFilesPerJob = 64;
+
+// Starts the pool with the given entries, then the files of iList if given, spread over the queues,
+// and waits until all is processed
+static void runPool(int iNbJobs, bool iRecursive, FileProcessor &iProcessor, const QList<WalkItem> &iItems, FileList *iList = 0)
+{
+    // The hold counts as a pending item
+    WalkerPool pool(iNbJobs, iRecursive, iProcessor, listedFilesPerJob * iNbJobs + 1);
+    pool.hold();
+    for (int i=0; i<iItems.size(); ++i)
+    {
+        pool.push(i % iNbJobs, iItems[i]);
+    }
+
+    QList<WalkerThread*> threads;
+    for (int i=0; i<iNbJobs; ++i)
+    {
+        WalkerThread* thread = new WalkerThread(pool, i);
+        threads.append(thread);
+        thread->start();
+    }
+    if (iList)
+    {
+        QString file;
+        for (int i=0; iList->next(file); ++i)
+        {
+            pool.waitForRoom();
+            WalkItem item = { QFileInfo(file), false };
+            pool.push(i % iNbJobs, item);
+        }
+    }
+    pool.release();
+    foreach (WalkerThread* thread, threads)
+    {
+        thread->wait();
+        delete thread;
+    }
+}
+
+FileWalker::FileWalker(const QString &iDirectory, bool iRecursive, int iNbJobs)
+    : m_directory(iDirectory), m_recursive(iRecursive), m_nbJobs(iNbJobs)
+{
+}
+
+void FileWalker::run(FileProcessor &iProcessor)
+{
+    if (m_nbJobs > 1)
+    {
+        WalkItem root = { QFileInfo(m_directory), true };
+        runPool(m_nbJobs, m_recursive, iProcessor, QList<WalkItem>() << root);
+    }
+    else
+    {
+        QDirIterator it(m_directory, QDir::Files | QDir::NoDotAndDotDot, (m_recursive?QDirIterator::Subdirectories:QDirIterator::NoIteratorFlags));
+        while (it.hasNext())
+        {
+            it.next();
+            iProcessor.processFile(it.fileInfo());
+        }
+    }
+}
+
+void FileWalker::run(const QStringList &iFiles, FileProcessor &iProcessor)
+{
+    if (m_nbJobs > 1)
+    {
+        QList<WalkItem> items;
+        foreach (const QString &file, iFiles)
+        {
+            WalkItem item = { QFileInfo(file), false };
+            items.append(item);
+        }
+        runPool(m_nbJobs, m_recursive, iProcessor, items);
+    }
+    else
+    {
+        foreach (const QString &file, iFiles)
+        {
+            iProcessor.processFile(QFileInfo(file));
+        }
+    }
+}
+
+void FileWalker::run(FileList &iFiles, FileProcessor &iProcessor)
+{
+    if (m_nbJobs > 1)
+    {
+        runPool(m_nbJobs, m_recursive, iProcessor, QList<WalkItem>(), &iFiles);
+    }
+    else
+    {
+        QString file;
+        while (iFiles.next(file))
+        {
+            iProcessor.processFile(QFileInfo(file));
+        }
+    }
+}
@@ -0,0 +1,59 @@
+/*
+ * This file is part of Neposync program.
+ * Copyright (C) 2010 Eric Pignet <eric at erixpage dot com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef FILEWALKER_H
+#define FILEWALKER_H
+
+#include <QtCore/QFileInfo>
+#include <QtCore/QString>
+#include <QtCore/QStringList>
+
+class FileList;
+
+// Receives the files found by a FileWalker.
+// With more than one job, processFile() is called concurrently from several threads.
+class FileProcessor
+{
+public:
+    virtual ~FileProcessor() {}
+    virtual void processFile(const QFileInfo &iFile) = 0;
+};
+
+// Walks the files of a directory, optionally recursively (symlinked directories are not followed).
+//
+// With one job, files are processed in the calling thread, in directory order.
+// With N jobs, N worker threads list directories and process files concurrently: each worker
+// pushes the entries of the directories it lists on its own queue, and idle workers steal the
+// oldest entries of the other queues, which are usually whole subdirectories.
+class FileWalker
+{
+public:
+    FileWalker(const QString &iDirectory, bool iRecursive, int iNbJobs = 1);
+    void run(FileProcessor &iProcessor);
+    // Processes the given files only, with the same number of jobs
+    void run(const QStringList &iFiles, FileProcessor &iProcessor);
+    // Processes the files of the list as they are read
+    void run(FileList &iFiles, FileProcessor &iProcessor);
+protected:
+    QString m_directory;
+    bool m_recursive;
+    int m_nbJobs;
+};
+
+#endif // FILEWALKER_H
@@ -24,68 +24,383 @@
 #include <taglib/popularimeterframe.h>
 
 #include <iostream>
+#include <cstring>
+
+#include <QtCore/QFile>
+#include <QtCore/QList>
 
 #include "ID3Utilities.h"
 
-bool ID3Utilities::getID3Rating(QString iFileName, int &oRating, bool isVerbose)
+//------------------
+// Direct ID3v2 access
+//
+// Ratings are read most of the time without any change to write: building a TagLib::MPEG::File
+// for that parses every frame of the tag. Common tags are read here directly instead.
+// Only ID3v2.3 and ID3v2.4 tags at the beginning of the file, without unsynchronisation, extended
+// header or footer, are handled. For any other tag these functions fail and TagLib is used.
+
+static const int ID3v2HeaderSize = 10;
+static const int ID3v2FrameHeaderSize = 10;
+
+static uint bigEndian(const char* iData)
+{
+    return (uint(uchar(iData[0])) << 24) | (uint(uchar(iData[1])) << 16) | (uint(uchar(iData[2])) << 8) | uint(uchar(iData[3]));
+}
+
+// 4 bytes of 7 bits, returns false if a byte has its high bit set
+static bool syncSafe(const char* iData, uint &oValue)
+{
+    oValue = 0;
+    for (int i=0; i<4; i++)
+    {
+        if (iData[i] & 0x80)
+            return false;
+        oValue = (oValue << 7) | uint(iData[i]);
+    }
+    return true;
+}
+
+// Reads the ID3v2 tag header and frames area of iFile (empty if the file has no ID3v2 tag)
+static bool readRawTag(QFile &iFile, QByteArray &oFrames, int &oVersion)
+{
+    oFrames.clear();
+    oVersion = 0;
+    QByteArray header = iFile.read(ID3v2HeaderSize);
+    if (header.size() < ID3v2HeaderSize || !header.startsWith("ID3"))
+    {
+        // No ID3v2 tag
+        return true;
+    }
+    oVersion = header[3];
+    uint size = 0;
+    if (   (oVersion != 3 && oVersion != 4)
+        || (header[5] & 0xD0) != 0     // unsynchronisation, extended header, footer
+        || !syncSafe(header.constData() + 6, size))
+    {
+        return false;
+    }
+    oFrames = iFile.read(size);
+    return (uint(oFrames.size()) == size);
+}
+
+// Finds all frames iFrameId in the frames area. Returns false if frames cannot be walked.
+// oPositions receives the position of their frame header, oEnd the position where padding starts.
+static bool findFrames(const QByteArray &iFrames, int iVersion, const char* iFrameId, QList<int> &oPositions, int &oEnd)
+{
+    oPositions.clear();
+    int position = 0;
+    while (position + ID3v2FrameHeaderSize <= iFrames.size() && iFrames[position] != 0)
+    {
+        const char* frame = iFrames.constData() + position;
+        for (int i=0; i<4; i++)
+        {
+            if (!((frame[i] >= 'A' && frame[i] <= 'Z') || (frame[i] >= '0' && frame[i] <= '9')))
+                return false;
+        }
+        uint size = 0;
+        if (iVersion == 4)
+        {
+            if (!syncSafe(frame + 4, size))
+                return false;
+        }
+        else
+        {
+            size = bigEndian(frame + 4);
+        }
+        if (size > uint(iFrames.size() - position - ID3v2FrameHeaderSize))
+        {
+            return false;
+        }
+        if (!strncmp(frame, iFrameId, 4))
+        {
+            oPositions.append(position);
+        }
+        position += ID3v2FrameHeaderSize + size;
+    }
+    oEnd = qMin(position, iFrames.size());
+    return true;
+}
+
+// Size of the frame at iPosition, header included (frames must have been walked by findFrames)
+static int frameSize(const QByteArray &iFrames, int iVersion, int iPosition)
+{
+    uint size = 0;
+    if (iVersion == 4)
+        syncSafe(iFrames.constData() + iPosition + 4, size);
+    else
+        size = bigEndian(iFrames.constData() + iPosition + 4);
+    return ID3v2FrameHeaderSize + size;
+}
+
+// Position of the rating byte of the POPM frame at iPosition, -1 if its data is encoded or has no rating.
+// POPM data: email (latin1, null terminated), rating (1 byte), counter (optional)
+static int popmRatingPosition(const QByteArray &iFrames, int iVersion, int iPosition)
+{
+    // Compressed, encrypted or otherwise encoded frame data
+    char formatFlags = iFrames[iPosition + 9];
+    if (formatFlags & (iVersion == 4 ? 0x4F : 0xE0))
+    {
+        return -1;
+    }
+    int dataPosition = iPosition + ID3v2FrameHeaderSize;
+    int dataSize = frameSize(iFrames, iVersion, iPosition) - ID3v2FrameHeaderSize;
+    const char* emailEnd = static_cast<const char*>(memchr(iFrames.constData() + dataPosition, 0, dataSize));
+    if (emailEnd == 0 || (emailEnd - iFrames.constData()) + 1 >= dataPosition + dataSize)
+    {
+        return -1;
+    }
+    return (emailEnd - iFrames.constData()) + 1;
+}
+
+// Rating (0-255) of the first POPM frame of a walked tag, if any. Returns false if the tag must be read by TagLib.
+static bool rawRating(const QByteArray &iFrames, int iVersion, const QList<int> &iPositions, bool &oFound, int &oRating)
 {
+    oFound = false;
     oRating = 0;
-    TagLib::MPEG::File file(QString(iFileName.toLocal8Bit()).toStdString().c_str());
-    if (file.ID3v2Tag())
+    if (iPositions.isEmpty())
+    {
+        // No POPM frame, or no ID3v2 tag at all
+        return true;
+    }
+    char formatFlags = iFrames[iPositions.first() + 9];
+    if (formatFlags & (iVersion == 4 ? 0x4F : 0xE0))
+    {
+        return false;
+    }
+    oFound = true;
+    int ratingPosition = popmRatingPosition(iFrames, iVersion, iPositions.first());
+    if (ratingPosition >= 0)
+    {
+        oRating = uchar(iFrames[ratingPosition]);
+    }
+    // else, POPM frame without rating
+    return true;
+}
+
+// Writes rating (0-255) in the walked ID3v2 tag without changing its size, and updates the walked tag.
+// Returns false if the tag must be saved by TagLib, otherwise oWritten tells if writing succeeded.
+// As with TagLib, all POPM frames are replaced by a single one. When there is only one POPM frame,
+// only its rating byte is patched (its email and play counter are kept).
+static bool writeRawRating(QFile &iFile, QByteArray &ioFrames, int iVersion, QList<int> &ioPositions, int &ioEnd,
+                           int iRating, bool &oWritten, bool isVerbose, std::ostream &ioOutput)
+{
+    oWritten = false;
+    if (ioFrames.isEmpty())
     {
-        TagLib::ID3v2::FrameList l = file.ID3v2Tag()->frameListMap()["POPM"];
-        if (!l.isEmpty())
+        return false;
+    }
+
+    if (ioPositions.size() == 1)
+    {
+        int ratingPosition = popmRatingPosition(ioFrames, iVersion, ioPositions.first());
+        if (ratingPosition >= 0)
         {
-            if (isVerbose)
-                std::cout << "  Full POPM frame: " << l.front()->toString() << std::endl;
-            TagLib::ID3v2::PopularimeterFrame *popFrame = new TagLib::ID3v2::PopularimeterFrame(l.front()->render());
-            if (popFrame != 0)
+            char rating = char(iRating);
+            oWritten = iFile.seek(ID3v2HeaderSize + ratingPosition) && iFile.write(&rating, 1) == 1;
+            if (oWritten)
             {
-                oRating = popFrame->rating();
+                ioFrames[ratingPosition] = rating;
                 if (isVerbose)
-                    std::cout << "  Convert " << oRating << "/255 to " << qRound(qreal(oRating) *10/255) << "/10" << std::endl;
-                oRating = qRound(qreal(oRating)*10/255);
+                    ioOutput << "  POPM frame patched in place (1 byte written)" << std::endl;
             }
+            return true;
         }
     }
+
+    // Remove POPM frames, then add the new one after the other frames, in the space of current tag
+    QByteArray newFrames;
+    newFrames.reserve(ioFrames.size());
+    int position = 0;
+    foreach (int popmPosition, ioPositions)
+    {
+        newFrames.append(ioFrames.mid(position, popmPosition - position));
+        position = popmPosition + frameSize(ioFrames, iVersion, popmPosition);
+    }
+    newFrames.append(ioFrames.mid(position, ioEnd - position));
+    int newPosition = newFrames.size();
+    // Same frame as TagLib renders: no email, rating, play counter 0 (size 6 is the same in ID3v2.3 and ID3v2.4)
+    static const char popmHeader[ID3v2FrameHeaderSize] = {'P', 'O', 'P', 'M', 0, 0, 0, 6, 0, 0};
+    newFrames.append(popmHeader, ID3v2FrameHeaderSize);
+    newFrames.append('\0');
+    newFrames.append(char(iRating));
+    newFrames.append(QByteArray(4, '\0'));
+    if (newFrames.size() > ioFrames.size())
+    {
+        // Not enough padding
+        return false;
+    }
+
+    // Only the part of the tag after the first POPM frame changes
+    int newEnd = newFrames.size();
+    int changeStart = ioPositions.isEmpty() ? ioEnd : ioPositions.first();
+    int changeEnd = qMax(newEnd, ioEnd);
+    newFrames.append(QByteArray(ioFrames.size() - newFrames.size(), '\0'));
+    oWritten = iFile.seek(ID3v2HeaderSize + changeStart)
+            && iFile.write(newFrames.constData() + changeStart, changeEnd - changeStart) == changeEnd - changeStart;
+    if (oWritten)
+    {
+        ioFrames = newFrames;
+        ioPositions.clear();
+        ioPositions.append(newPosition);
+        ioEnd = newEnd;
+        if (isVerbose)
+            ioOutput << "  POPM frame written in ID3v2 tag padding (" << (changeEnd - changeStart) << " bytes written)" << std::endl;
+    }
     return true;
 }
 
+//------------------
+// ID3Session
 
-bool ID3Utilities::setID3Rating(QString iFileName, int iRating, bool isVerbose)
+ID3Session::ID3Session(QString iFileName, bool isVerbose, std::ostream &iOutput)
+    : m_fileName(iFileName), m_isVerbose(isVerbose), m_output(iOutput), m_file(iFileName), m_isLoaded(false), m_isRaw(false),
+      m_version(0), m_end(0), m_tagLibFile(0), m_rating(0)
+{
+}
+
+ID3Session::~ID3Session()
+{
+    delete m_tagLibFile;
+}
+
+// Opens and parses the file, once
+void ID3Session::load()
+{
+    if (m_isLoaded)
+        return;
+    m_isLoaded = true;
+
+    // Opened read-only: a file opened for writing is reported as written when closed (see --watch)
+    if (   m_file.open(QIODevice::ReadOnly)
+        && readRawTag(m_file, m_frames, m_version)
+        && findFrames(m_frames, m_version, "POPM", m_positions, m_end))
+    {
+        bool found = false;
+        m_isRaw = rawRating(m_frames, m_version, m_positions, found, m_rating);
+        if (m_isRaw && found && m_isVerbose)
+            m_output << "  POPM frame read directly from ID3v2 tag" << std::endl;
+    }
+
+    if (!m_isRaw)
+    {
+        // Unusual tag: full parsing by TagLib (audio properties are not needed)
+        m_rating = 0;
+        loadTagLib();
+        if (m_tagLibFile->ID3v2Tag())
+        {
+            TagLib::ID3v2::FrameList l = m_tagLibFile->ID3v2Tag()->frameListMap()["POPM"];
+            if (!l.isEmpty())
+            {
+                if (m_isVerbose)
+                    m_output << "  Full POPM frame: " << l.front()->toString() << std::endl;
+                TagLib::ID3v2::PopularimeterFrame popFrame(l.front()->render());
+                m_rating = popFrame.rating();
+            }
+        }
+    }
+}
+
+void ID3Session::loadTagLib()
+{
+    if (!m_tagLibFile)
+    {
+        m_file.close();
+        m_tagLibFile = new TagLib::MPEG::File(QString(m_fileName.toLocal8Bit()).toStdString().c_str(), false);
+    }
+}
+
+int ID3Session::rating()
+{
+    load();
+    int rating = qRound(qreal(m_rating)*10/255);
+    if (m_isVerbose && m_rating > 0)
+        m_output << "  Convert " << m_rating << "/255 to " << rating << "/10" << std::endl;
+    return rating;
+}
+
+bool ID3Session::setRating(int iRating)
 {
-    TagLib::MPEG::File f(QString(iFileName.toLocal8Bit()).toStdString().c_str());
+    load();
+    int newRating = qRound(qreal(iRating) * 255 / 10);
+    if (m_isVerbose)
+        m_output << "  Convert " << iRating << "/10 to " << newRating << "/255" << std::endl;
+
+    // Whenever the new POPM frame fits in the current tag, only the changed bytes are written
+    if (m_isRaw && !m_frames.isEmpty())
+    {
+        // Reopened for writing only now (QFile would create a file that vanished since it was read)
+        if (!(m_file.openMode() & QIODevice::WriteOnly))
+        {
+            m_file.close();
+            if (!m_file.exists() || !m_file.open(QIODevice::ReadWrite))
+            {
+                m_output << "  Cannot save file" << std::endl;
+                return false;
+            }
+        }
+        bool written = false;
+        if (writeRawRating(m_file, m_frames, m_version, m_positions, m_end, newRating, written, m_isVerbose, m_output))
+        {
+            if (!written)
+            {
+                m_output << "  Cannot save file" << std::endl;
+                return false;
+            }
+            m_rating = newRating;
+            return true;
+        }
+    }
+
+    // Last resort: TagLib saves the whole tag, and rewrites the file if the tag size changes
+    m_isRaw = false;
+    loadTagLib();
     // Check to make sure that it has an ID3v2 tag
     // TODO add ID3v2 tag if needed
-    if(f.ID3v2Tag())
+    if(m_tagLibFile->ID3v2Tag())
     {
-        f.ID3v2Tag()->removeFrames("POPM");
+        m_tagLibFile->ID3v2Tag()->removeFrames("POPM");
 
         TagLib::ID3v2::PopularimeterFrame *popFrame = new TagLib::ID3v2::PopularimeterFrame();
         if (popFrame != 0)
         {
-            if (isVerbose)
-                std::cout << "  Convert " << iRating << "/10 to " << qRound(qreal(iRating) * 255 / 10) << "/255" << std::endl;
-            popFrame->setRating(qRound(qreal(iRating) * 255 / 10));
-            f.ID3v2Tag()->addFrame(popFrame);
-            if (!f.save())
+            popFrame->setRating(newRating);
+            m_tagLibFile->ID3v2Tag()->addFrame(popFrame);
+            if (!m_tagLibFile->save())
             {
-                std::cout << "Cannot save file" << std::endl;
+                m_output << "  Cannot save file" << std::endl;
                 return false;
             }
+            m_rating = newRating;
+            if (m_isVerbose)
+                m_output << "  ID3v2 tag saved by TagLib (up to " << m_tagLibFile->length() << " bytes written)" << std::endl;
         }
         else
         {
-            std::cout << "Cannot create ID3v2 frame" << std::endl;
+            m_output << "  Cannot create ID3v2 frame" << std::endl;
             return false;
         }
     }
     else
     {
-        std::cout << "This file has no ID3v2 tag. No ID3v2 creation in Neposync so far" << std::endl;
+        m_output << "  This file has no ID3v2 tag. No ID3v2 creation in Neposync so far" << std::endl;
         return false;
     }
     return true;
 }
 
+//------------------
+// ID3Utilities
+
+bool ID3Utilities::getID3Rating(QString iFileName, int &oRating, bool isVerbose)
+{
+    ID3Session session(iFileName, isVerbose);
+    oRating = session.rating();
+    return true;
+}
+
 
+bool ID3Utilities::setID3Rating(QString iFileName, int iRating, bool isVerbose)
+{
+    ID3Session session(iFileName, isVerbose);
+    return session.setRating(iRating);
+}
@@ -21,6 +21,46 @@
 #define ID3UTILITIES_H
 
 #include <QtCore/QString>
+#include <QtCore/QFile>
+#include <QtCore/QByteArray>
+#include <QtCore/QList>
+
+#include <iostream>
+
+namespace TagLib { namespace MPEG { class File; } }
+
+// Rating of one MP3 file, read and written with the file opened and parsed only once
+class ID3Session
+{
+public:
+    // Messages about the file (verbose details and errors) are written to iOutput
+    ID3Session(QString iFileName, bool isVerbose = false, std::ostream &iOutput = std::cout);
+    ~ID3Session();
+    // Rating /10 (0 if none)
+    int rating();
+    bool setRating(int iRating);
+protected:
+    QString m_fileName;
+    bool m_isVerbose;
+    std::ostream &m_output;
+    QFile m_file;
+    bool m_isLoaded;
+    // Tag read directly (see ID3Utilities.cpp): frames area, version, POPM frames positions, end of frames
+    bool m_isRaw;
+    QByteArray m_frames;
+    int m_version;
+    QList<int> m_positions;
+    int m_end;
+    // Tag read by TagLib, for unusual tags
+    TagLib::MPEG::File* m_tagLibFile;
+    // Rating /255
+    int m_rating;
+    void load();
+    void loadTagLib();
+private:
+    ID3Session(const ID3Session&);
+    ID3Session& operator=(const ID3Session&);
+};
 
 class ID3Utilities
 {
@@ -0,0 +1,174 @@
+/*
+ * This file is part of Neposync program.
+ * Copyright (C) 2010 Eric Pignet <eric at erixpage dot com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+
+#include "ImageMetadata.h"
+#include "JPEGUtilities.h"
+
+#include <QtCore/QFile>
+#include <QtCore/QMutex>
+#include <QtCore/QMutexLocker>
+
+#include <libkexiv2/kexiv2.h>
+
+// Exiv2 XMP toolkit is initialized without a lock function, so it must not be used by several
+// threads at once: all KExiv2 accesses are serialized. The JPEG header scan is not.
+static QMutex exiv2Mutex;
+
+ImageMetadata::ImageMetadata(QString iFileName, bool iUseSidecar)
+    : m_fileName(iFileName), m_useSidecar(iUseSidecar), m_isSidecar(false), m_metadata(0), m_changeCount(0),
+      m_isScanned(false), m_isScanValid(false)
+{
+}
+
+ImageMetadata::~ImageMetadata()
+{
+    QMutexLocker locker(&exiv2Mutex);
+    delete m_metadata;
+}
+
+QString ImageMetadata::sidecarFileName(const QString &iFileName)
+{
+    return iFileName + ".xmp";
+}
+
+void ImageMetadata::setKnownValues(const QStringList &iKeywords, const QString &iRating)
+{
+    m_isScanned = true;
+    m_isScanValid = true;
+    m_scannedKeywords = iKeywords;
+    m_scannedRating = iRating;
+}
+
+// Metadata is loaded on first access only, from the sidecar if it is used and exists
+KExiv2Iface::KExiv2& ImageMetadata::metadata()
+{
+    if (!m_metadata)
+    {
+        QFile sidecar(sidecarFileName(m_fileName));
+        if (m_useSidecar && sidecar.open(QIODevice::ReadOnly))
+        {
+            m_metadata = new KExiv2Iface::KExiv2();
+            m_metadata->setXmp(sidecar.readAll());
+            m_isSidecar = true;
+        }
+        else
+        {
+            m_metadata = new KExiv2Iface::KExiv2(m_fileName);
+        }
+    }
+    return *m_metadata;
+}
+
+// Metadata where changes are made: when a sidecar is used but does not exist yet,
+// it is created from the image XMP and keywords. Keywords of the image are read from IPTC
+// (see keywords()), so the XMP subject is replaced by them rather than merged with them.
+KExiv2Iface::KExiv2& ImageMetadata::writableMetadata()
+{
+    metadata();
+    if (m_useSidecar && !m_isSidecar)
+    {
+        KExiv2Iface::KExiv2* sidecar = new KExiv2Iface::KExiv2();
+        sidecar->setXmp(m_metadata->getXmp());
+        sidecar->removeXmpTag("Xmp.dc.subject");
+        sidecar->setXmpKeywords(m_metadata->getIptcKeywords());
+        delete m_metadata;
+        m_metadata = sidecar;
+        m_isSidecar = true;
+    }
+    return *m_metadata;
+}
+
+// Fast read of the image header, as long as nothing has to be written.
+// Not used when metadata comes from a sidecar.
+bool ImageMetadata::scan()
+{
+    if (m_metadata)
+    {
+        return false;
+    }
+    if (!m_isScanned)
+    {
+        m_isScanned = true;
+        m_isScanValid =    !(m_useSidecar && QFile::exists(sidecarFileName(m_fileName)))
+                        && JPEGUtilities::readMetadata(m_fileName, m_scannedKeywords, m_scannedRating);
+    }
+    return m_isScanValid;
+}
+
+QStringList ImageMetadata::keywords()
+{
+    if (scan())
+    {
+        return m_scannedKeywords;
+    }
+    QMutexLocker locker(&exiv2Mutex);
+    KExiv2Iface::KExiv2& data = metadata();
+    return m_isSidecar ? data.getXmpKeywords() : data.getIptcKeywords();
+}
+
+QString ImageMetadata::rating()
+{
+    if (scan())
+    {
+        return m_scannedRating;
+    }
+    QMutexLocker locker(&exiv2Mutex);
+    return metadata().getXmpTagString("Xmp.xmp.Rating");
+}
+
+void ImageMetadata::setKeywords(const QStringList &iOldKeywords, const QStringList &iNewKeywords)
+{
+    QMutexLocker locker(&exiv2Mutex);
+    KExiv2Iface::KExiv2& data = writableMetadata();
+    if (m_isSidecar)
+    {
+        data.removeXmpKeywords(iOldKeywords);
+        data.setXmpKeywords(iNewKeywords);
+    }
+    else
+    {
+        data.setIptcKeywords(iOldKeywords, iNewKeywords);
+    }
+    m_changeCount++;
+}
+
+void ImageMetadata::setRating(const QString &iRating)
+{
+    QMutexLocker locker(&exiv2Mutex);
+    writableMetadata().setXmpTagString("Xmp.xmp.Rating", iRating, false);
+    m_changeCount++;
+}
+
+bool ImageMetadata::commit()
+{
+    if (m_changeCount == 0)
+    {
+        return true;
+    }
+    m_changeCount = 0;
+    QMutexLocker locker(&exiv2Mutex);
+    if (m_isSidecar)
+    {
+        QFile sidecar(sidecarFileName(m_fileName));
+        QByteArray xmp = m_metadata->getXmp();
+        return sidecar.open(QIODevice::WriteOnly | QIODevice::Truncate) && sidecar.write(xmp) == xmp.size();
+    }
+    return m_metadata->applyChanges();
+}
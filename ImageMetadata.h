@@ -0,0 +1,73 @@
+/*
+ * This file is part of Neposync program.
+ * Copyright (C) 2010 Eric Pignet <eric at erixpage dot com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+
+#ifndef IMAGEMETADATA_H
+#define IMAGEMETADATA_H
+
+#include <QtCore/QString>
+#include <QtCore/QStringList>
+
+namespace KExiv2Iface { class KExiv2; }
+
+// Tags (IPTC keywords) and rating (XMP Rating) of one image file.
+// Metadata is loaded at most once, and all changes are written at once by commit().
+//
+// With iUseSidecar, metadata is read from the XMP sidecar file (image.jpg.xmp, as Digikam) when it
+// exists, from the image otherwise, and changes are always written to the sidecar, which leaves
+// the image untouched. In a sidecar, tags are stored as XMP keywords (Xmp.dc.subject).
+class ImageMetadata
+{
+public:
+    ImageMetadata(QString iFileName, bool iUseSidecar = false);
+    ~ImageMetadata();
+    QStringList keywords();
+    // Null string if the image has no rating
+    QString rating();
+    void setKeywords(const QStringList &iOldKeywords, const QStringList &iNewKeywords);
+    // A null string clears the rating
+    void setRating(const QString &iRating);
+    // Number of changes waiting for commit()
+    int changeCount() const { return m_changeCount; }
+    static QString sidecarFileName(const QString &iFileName);
+    // Values known without reading the file (see StateCache), used until metadata is loaded
+    void setKnownValues(const QStringList &iKeywords, const QString &iRating);
+    // Writes pending changes, if any. Returns false if the file could not be written.
+    bool commit();
+protected:
+    QString m_fileName;
+    bool m_useSidecar;
+    // True if m_metadata holds the sidecar content
+    bool m_isSidecar;
+    KExiv2Iface::KExiv2* m_metadata;
+    int m_changeCount;
+    // Values read from the JPEG header without KExiv2 (see JPEGUtilities), used until metadata is loaded
+    bool m_isScanned;
+    bool m_isScanValid;
+    QStringList m_scannedKeywords;
+    QString m_scannedRating;
+    bool scan();
+    KExiv2Iface::KExiv2& metadata();
+    KExiv2Iface::KExiv2& writableMetadata();
+private:
+    ImageMetadata(const ImageMetadata&);
+    ImageMetadata& operator=(const ImageMetadata&);
+};
+
+#endif // IMAGEMETADATA_H
@@ -0,0 +1,249 @@
+/*
+ * This file is part of Neposync program.
+ * Copyright (C) 2010 Eric Pignet <eric at erixpage dot com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+
+#include "JPEGUtilities.h"
+
+#include <cstring>
+#include <cctype>
+
+#include <QtCore/QFile>
+#include <QtCore/QByteArray>
+
+// Most files of a sync need no change, so reading their metadata is the bulk of the work.
+// Here the file is mapped and only the markers before the image data (SOS) are walked:
+// IPTC keywords come from the Photoshop APP13 segment, the XMP rating from the APP1 XMP packet.
+// Anything unusual (IPTC character set, extended datasets, several segments, extended XMP,
+// ambiguous XMP) is left to KExiv2.
+
+static uint bigEndian16(const uchar* iData)
+{
+    return (uint(iData[0]) << 8) | uint(iData[1]);
+}
+
+static uint bigEndian32(const uchar* iData)
+{
+    return (uint(iData[0]) << 24) | (uint(iData[1]) << 16) | (uint(iData[2]) << 8) | uint(iData[3]);
+}
+
+// IPTC datasets: 0x1C, record, dataset, size (2 bytes), data
+static bool readIptcKeywords(const uchar* iData, uint iSize, QStringList &oKeywords)
+{
+    uint position = 0;
+    while (position + 5 <= iSize && iData[position] == 0x1C)
+    {
+        uint record = iData[position + 1];
+        uint dataset = iData[position + 2];
+        uint size = bigEndian16(iData + position + 3);
+        if ((size & 0x8000) || position + 5 + size > iSize)
+        {
+            // Extended dataset, or corrupted data
+            return false;
+        }
+        if (record == 1 && dataset == 90)
+        {
+            // Coded character set: keywords encoding depends on KExiv2 version
+            return false;
+        }
+        if (record == 2 && dataset == 25)
+        {
+            // Same decoding as QString(const char*) used by KExiv2
+            oKeywords.append(QString::fromLatin1(reinterpret_cast<const char*>(iData + position + 5), size));
+        }
+        position += 5 + size;
+    }
+    return true;
+}
+
+// Photoshop image resources: "8BIM", id (2 bytes), padded pascal name, size (4 bytes), padded data
+static bool readPhotoshopResources(const uchar* iData, uint iSize, QStringList &oKeywords)
+{
+    uint position = 0;
+    bool iptcFound = false;
+    while (position + 4 <= iSize && !memcmp(iData + position, "8BIM", 4))
+    {
+        if (position + 7 > iSize)
+            return false;
+        uint id = bigEndian16(iData + position + 4);
+        uint nameSize = iData[position + 6];
+        uint sizePosition = position + 6 + ((nameSize + 2) & ~1U);
+        if (sizePosition + 4 > iSize)
+            return false;
+        uint size = bigEndian32(iData + sizePosition);
+        uint dataPosition = sizePosition + 4;
+        if (size > iSize - dataPosition)
+            return false;
+        if (id == 0x0404)
+        {
+            if (iptcFound || !readIptcKeywords(iData + dataPosition, size, oKeywords))
+                return false;
+            iptcFound = true;
+        }
+        position = dataPosition + ((size + 1) & ~1U);
+    }
+    return true;
+}
+
+// Value of the XMP Rating property, in attribute or element form
+static bool readXmpRating(const char* iData, uint iSize, QString &oRating)
+{
+    const QByteArray packet = QByteArray::fromRawData(iData, iSize);
+
+    // Prefix bound to XMP basic namespace (usually xmp, or xap in older files)
+    QByteArray prefix;
+    const char* namespaceValues[] = { "=\"http://ns.adobe.com/xap/1.0/\"", "='http://ns.adobe.com/xap/1.0/'" };
+    for (int n=0; n<2; n++)
+    {
+        int position = 0;
+        while ((position = packet.indexOf(namespaceValues[n], position)) >= 0)
+        {
+            int start = packet.lastIndexOf("xmlns:", position);
+            if (start < 0)
+                return false;
+            QByteArray declaredPrefix = packet.mid(start + 6, position - start - 6);
+            if (!prefix.isEmpty() && prefix != declaredPrefix)
+                return false;
+            prefix = declaredPrefix;
+            position++;
+        }
+    }
+    if (prefix.isEmpty())
+    {
+        // No XMP basic property
+        return true;
+    }
+
+    QByteArray name = prefix + ":Rating";
+    int position = 0;
+    while ((position = packet.indexOf(name, position)) >= 0)
+    {
+        int end = position + name.size();
+        if (position == 0 || end >= packet.size())
+            return false;
+        char before = packet[position - 1];
+        char after = packet[end];
+        position = end;
+        if (before == '/' || (before != '<' && !isspace(uchar(before))))
+        {
+            // Closing tag, or another name ending with this one
+            continue;
+        }
+        int valueStart = -1;
+        int valueEnd = -1;
+        if (after == '=' && end + 1 < packet.size() && (packet[end + 1] == '"' || packet[end + 1] == '\''))
+        {
+            valueStart = end + 2;
+            valueEnd = packet.indexOf(packet[end + 1], valueStart);
+        }
+        else if (after == '>' && before == '<')
+        {
+            valueStart = end + 1;
+            valueEnd = packet.indexOf('<', valueStart);
+        }
+        else if (after == '_' || after == '-' || after == '.' || isalnum(uchar(after)))
+        {
+            // Another name starting with this one
+            continue;
+        }
+        if (valueEnd < 0 || !oRating.isNull())
+        {
+            // Qualified or structured value, or several values
+            return false;
+        }
+        QByteArray value = packet.mid(valueStart, valueEnd - valueStart);
+        if (value.contains('&'))
+            return false;
+        oRating = QString::fromUtf8(value.constData(), value.size());
+    }
+    return true;
+}
+
+bool JPEGUtilities::readMetadata(QString iFileName, QStringList &oKeywords, QString &oRating)
+{
+    static const char xmpSignature[] = "http://ns.adobe.com/xap/1.0/";
+    static const char extendedXmpSignature[] = "http://ns.adobe.com/xmp/extension/";
+    static const char photoshopSignature[] = "Photoshop 3.0";
+
+    oKeywords.clear();
+    oRating = QString();
+
+    QFile file(iFileName);
+    if (!file.open(QIODevice::ReadOnly) || file.size() < 4)
+        return false;
+    // Mapping: only the pages of the header are actually read
+    const uchar* data = file.map(0, file.size());
+    if (!data)
+        return false;
+    uint size = uint(file.size());
+
+    if (data[0] != 0xFF || data[1] != 0xD8)
+        return false;
+
+    bool xmpFound = false;
+    bool photoshopFound = false;
+    uint position = 2;
+    while (true)
+    {
+        if (position + 2 > size || data[position] != 0xFF)
+            return false;
+        // Fill bytes
+        while (position + 2 <= size && data[position + 1] == 0xFF)
+            position++;
+        if (position + 2 > size)
+            return false;
+        uchar marker = data[position + 1];
+        if (marker == 0xDA || marker == 0xD9)
+        {
+            // Start of scan or end of image: no metadata after this point
+            break;
+        }
+        if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7))
+        {
+            // Marker without segment
+            position += 2;
+            continue;
+        }
+        if (position + 4 > size)
+            return false;
+        uint length = bigEndian16(data + position + 2);
+        if (length < 2 || position + 2 + length > size)
+            return false;
+        const uchar* segment = data + position + 4;
+        uint segmentSize = length - 2;
+
+        if (marker == 0xE1 && segmentSize >= sizeof(extendedXmpSignature) && !memcmp(segment, extendedXmpSignature, sizeof(extendedXmpSignature)))
+        {
+            return false;
+        }
+        if (marker == 0xE1 && segmentSize >= sizeof(xmpSignature) && !memcmp(segment, xmpSignature, sizeof(xmpSignature)))
+        {
+            if (xmpFound || !readXmpRating(reinterpret_cast<const char*>(segment) + sizeof(xmpSignature), segmentSize - sizeof(xmpSignature), oRating))
+                return false;
+            xmpFound = true;
+        }
+        if (marker == 0xED && segmentSize >= sizeof(photoshopSignature) && !memcmp(segment, photoshopSignature, sizeof(photoshopSignature)))
+        {
+            if (photoshopFound || !readPhotoshopResources(segment + sizeof(photoshopSignature), segmentSize - sizeof(photoshopSignature), oKeywords))
+                return false;
+            photoshopFound = true;
+        }
+        position += 2 + length;
+    }
+    return true;
+}
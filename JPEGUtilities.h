@@ -0,0 +1,35 @@
+/*
+ * This file is part of Neposync program.
+ * Copyright (C) 2010 Eric Pignet <eric at erixpage dot com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+
+#ifndef JPEGUTILITIES_H
+#define JPEGUTILITIES_H
+
+#include <QtCore/QString>
+#include <QtCore/QStringList>
+
+class JPEGUtilities
+{
+public:
+    // Reads IPTC keywords and XMP rating (null if none) from the JPEG header, without Exiv2.
+    // Returns false if the file is not handled and must be read by KExiv2.
+    static bool readMetadata(QString iFileName, QStringList &oKeywords, QString &oRating);
+};
+
+#endif // JPEGUTILITIES_H
@@ -0,0 +1,158 @@
+/*
+ * This file is part of Neposync program.
+ * Copyright (C) 2010 Eric Pignet <eric at erixpage dot com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "MetadataStore.h"
+
+#include <iostream>
+#include <sstream>
+
+#include <QtCore/QUrl>
+
+QByteArray MetadataStore::sortKey(const QString &iFileName)
+{
+    return QUrl::fromLocalFile(iFileName).toEncoded();
+}
+
+bool StoreSync::run(const QString &iDirectory, bool iRecursive)
+{
+    StoreCursor* source = m_source.scan(iDirectory, iRecursive);
+    if (!source)
+    {
+        return false;
+    }
+    StoreCursor* destination = m_destination.scan(iDirectory, iRecursive);
+    if (!destination)
+    {
+        delete source;
+        return false;
+    }
+
+    // Entries of the same file are found together, the entry with the lowest key being handled first
+    StoreEntry sourceEntry;
+    StoreEntry destinationEntry;
+    QByteArray sourceKey;
+    QByteArray destinationKey;
+    bool isSourceEnd = false;
+    bool isDestinationEnd = false;
+    bool ok = next(m_source, *source, sourceEntry, sourceKey, isSourceEnd)
+           && next(m_destination, *destination, destinationEntry, destinationKey, isDestinationEnd);
+    while (ok && (!isSourceEnd || !isDestinationEnd))
+    {
+        int order = (isSourceEnd ? 1 : (isDestinationEnd ? -1 : qstrcmp(sourceKey, destinationKey)));
+        if (order < 0)
+        {
+            copy(&sourceEntry, 0);
+            ok = next(m_source, *source, sourceEntry, sourceKey, isSourceEnd);
+        }
+        else if (order > 0)
+        {
+            copy(0, &destinationEntry);
+            ok = next(m_destination, *destination, destinationEntry, destinationKey, isDestinationEnd);
+        }
+        else
+        {
+            copy(&sourceEntry, &destinationEntry);
+            ok = next(m_source, *source, sourceEntry, sourceKey, isSourceEnd)
+              && next(m_destination, *destination, destinationEntry, destinationKey, isDestinationEnd);
+        }
+    }
+    delete source;
+    delete destination;
+    if (m_isVerbose)
+    {
+        std::cout << "Merged " << m_nbEntries[0] << " " << m_source.storeName() << " files with "
+                  << m_nbEntries[1] << " " << m_destination.storeName() << " files" << std::endl;
+    }
+
+    bool isWritten = m_destination.flush();
+    return ok && isWritten && !m_isFailed;
+}
+
+// Reads the next entry of a store, checking that entries come in key order
+bool StoreSync::next(MetadataStore &iStore, StoreCursor &iCursor, StoreEntry &oEntry, QByteArray &ioKey, bool &oIsEnd)
+{
+    if (!iCursor.next(oEntry))
+    {
+        oIsEnd = true;
+        return !iCursor.isError();
+    }
+    QByteArray key = MetadataStore::sortKey(oEntry.fileName);
+    if (!ioKey.isNull() && qstrcmp(key, ioKey) <= 0)
+    {
+        std::cout << "Error: " << iStore.storeName() << " files are not sorted: " << key.constData() << " after " << ioKey.constData() << std::endl;
+        return false;
+    }
+    ioKey = key;
+    m_nbEntries[&iStore == &m_source ? 0 : 1]++;
+    return true;
+}
+
+void StoreSync::copy(const StoreEntry* iSource, const StoreEntry* iDestination)
+{
+    QString fileName = (iSource ? iSource->fileName : iDestination->fileName);
+    StoreEntry source(iSource ? *iSource : StoreEntry(fileName));
+    StoreEntry oldEntry(iDestination ? *iDestination : StoreEntry(fileName));
+    // Tags are compared and written sorted
+    oldEntry.tags.sort();
+    StoreEntry newEntry(oldEntry);
+    std::ostringstream changes;
+
+    // Copy of tags, if both stores have tags for this file
+    if ((!source.tags.isEmpty() || m_forceCopy) && m_source.handlesTags(fileName) && m_destination.handlesTags(fileName))
+    {
+        QStringList newTags(source.tags);
+        newTags.sort();
+        if (oldEntry.tags != newTags)
+        {
+            changes << "  Needs to replace tags:";
+            foreach (const QString &tag, newTags) changes << " " << std::string(tag.toLocal8Bit());
+            changes << std::endl;
+            newEntry.tags = newTags;
+        }
+    }
+
+    // Copy of rating
+    if (source.hasRating)
+    {
+        if (!oldEntry.hasRating || oldEntry.rating != source.rating)
+        {
+            changes << "  Needs to copy rating: " << source.rating << std::endl;
+            newEntry.hasRating = true;
+            newEntry.rating = source.rating;
+        }
+    }
+    else if (m_forceCopy && oldEntry.hasRating)
+    {
+        changes << "  Needs to clear rating" << std::endl;
+        newEntry.hasRating = false;
+        newEntry.rating = 0;
+    }
+
+    if (changes.str().empty() || !m_source.handles(fileName) || !m_destination.handles(fileName))
+    {
+        return;
+    }
+    std::cout << "File: " << std::string(fileName.toLocal8Bit()) << std::endl << changes.str();
+    m_nbChanged++;
+    if (!m_destination.update(oldEntry, newEntry))
+    {
+        std::cout << "  Cannot write " << m_destination.storeName() << std::endl;
+        m_isFailed = true;
+    }
+}
@@ -0,0 +1,98 @@
+/*
+ * This file is part of Neposync program.
+ * Copyright (C) 2010 Eric Pignet <eric at erixpage dot com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef METADATASTORE_H
+#define METADATASTORE_H
+
+#include <QtCore/QByteArray>
+#include <QtCore/QString>
+#include <QtCore/QStringList>
+
+// Tags and rating (/10) of one file in a store
+struct StoreEntry
+{
+    // Absolute path
+    QString fileName;
+    QStringList tags;
+    bool hasRating;
+    int rating;
+
+    StoreEntry(const QString &iFileName = QString()) : fileName(iFileName), hasRating(false), rating(0) {}
+};
+
+// Entries of a store, in increasing order of MetadataStore::sortKey()
+class StoreCursor
+{
+public:
+    StoreCursor() : m_isError(false) {}
+    virtual ~StoreCursor() {}
+    // Returns false after the last entry, or on error (isError() is then true)
+    virtual bool next(StoreEntry &oEntry) = 0;
+    bool isError() const { return m_isError; }
+protected:
+    bool m_isError;
+};
+
+// A place where tags and ratings of files are kept (files themselves, Nepomuk, Amarok), seen as a
+// list of entries sorted by file, so that any two stores can be synchronized by StoreSync.
+class MetadataStore
+{
+public:
+    virtual ~MetadataStore() {}
+    virtual const char* storeName() const = 0;
+    // Whether the store can keep tags and rating of iFileName, and its tags
+    virtual bool handles(const QString &iFileName) const = 0;
+    virtual bool handlesTags(const QString &iFileName) const = 0;
+    // Entries of the files with tags or rating under iDirectory, to delete once read. 0 on error.
+    virtual StoreCursor* scan(const QString &iDirectory, bool iRecursive) = 0;
+    // Changes iOld, an entry of the scan (or an empty entry if the file has none), to iNew.
+    // Changes may be written by batches, until flush().
+    virtual bool update(const StoreEntry &iOld, const StoreEntry &iNew) = 0;
+    virtual bool flush() = 0;
+
+    // Order of the entries of all stores: their file:// url, as Nepomuk orders them
+    static QByteArray sortKey(const QString &iFileName);
+};
+
+// Copies tags and ratings of the files under a directory from a store to another, by a merge-join
+// of the scans of both stores: each is read once, in key order, and only the current entry of each
+// is compared. No store is queried file by file, except to write changes.
+class StoreSync
+{
+public:
+    StoreSync(MetadataStore &iSource, MetadataStore &iDestination, bool iForceCopy = false, bool isVerbose = false)
+        : m_source(iSource), m_destination(iDestination), m_forceCopy(iForceCopy), m_isVerbose(isVerbose), m_nbChanged(0), m_isFailed(false) { m_nbEntries[0] = m_nbEntries[1] = 0; }
+    // Returns false if a store could not be read, or if a change could not be written
+    bool run(const QString &iDirectory, bool iRecursive);
+    int nbChanged() const { return m_nbChanged; }
+protected:
+    MetadataStore &m_source;
+    MetadataStore &m_destination;
+    bool m_forceCopy;
+    bool m_isVerbose;
+    int m_nbChanged;
+    bool m_isFailed;
+    // Entries read from the source and from the destination
+    int m_nbEntries[2];
+    bool next(MetadataStore &iStore, StoreCursor &iCursor, StoreEntry &oEntry, QByteArray &ioKey, bool &oIsEnd);
+    // iSource or iDestination is 0 if the file has no entry in the store
+    void copy(const StoreEntry* iSource, const StoreEntry* iDestination);
+};
+
+#endif // METADATASTORE_H
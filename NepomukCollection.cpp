@@ -0,0 +1,512 @@
+/*
+ * This file is part of Neposync program.
+ * Copyright (C) 2010 Eric Pignet <eric at erixpage dot com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "NepomukCollection.h"
+
+#include <iostream>
+
+#include <nepomuk/resourcemanager.h>
+#include <nepomuk/tag.h>
+#include <nepomuk/variant.h>
+#include <Soprano/LiteralValue>
+#include <Soprano/Model>
+#include <Soprano/Node>
+#include <Soprano/NRLModel>
+#include <Soprano/QueryResultIterator>
+#include <Soprano/Vocabulary/NAO>
+#include <Soprano/Vocabulary/NRL>
+#include <Soprano/Vocabulary/RDF>
+#include <QtCore/QMutexLocker>
+#include <QtCore/QRegExp>
+
+// File resources are found by their nie:url (file:// url)
+static const char nieUrl[] = "http://www.semanticdesktop.org/ontologies/2007/01/19/nie#url";
+// Type of the file resources created
+static const char nfoFileDataObject[] = "http://www.semanticdesktop.org/ontologies/2007/03/22/nfo#FileDataObject";
+
+NepomukCollection::NepomukCollection(bool isVerbose)
+    : m_isVerbose(isVerbose), m_hasSnapshot(false), m_hasTagList(false),
+      m_batchSize(500), m_nbPendingFiles(0), m_batchFailed(false), m_requests(0)
+{
+}
+
+NepomukCollection::~NepomukCollection()
+{
+    if (m_requests)
+    {
+        m_requests->close();
+        foreach (QThread* thread, m_requestThreads)
+        {
+            thread->wait();
+            delete thread;
+        }
+        delete m_requests;
+    }
+    flushChanges();
+}
+
+static QString n3(const QUrl &iUri)
+{
+    return Soprano::Node::resourceToN3(iUri);
+}
+
+static Soprano::Model* mainModel()
+{
+    return Nepomuk::ResourceManager::instance()->mainModel();
+}
+
+// Runs a SPARQL query on Nepomuk main model. Errors are reported by the model, see lastError().
+static Soprano::QueryResultIterator executeQuery(const QString &iQuery)
+{
+    return mainModel()->executeQuery(iQuery, Soprano::Query::QueryLanguageSparql);
+}
+
+// Adds a tag (nao:hasTag) or rating (nao:numericRating) statement to the file
+static void addStatement(NepomukFile &ioFile, const Soprano::Statement &iStatement, const QString &iTagLabel)
+{
+    ioFile.resourceUri = iStatement.subject().uri();
+    if (iStatement.predicate().uri() == Soprano::Vocabulary::NAO::hasTag())
+    {
+        ioFile.tagUris.append(iStatement.object().uri());
+        ioFile.tagLabels.append(iTagLabel);
+        ioFile.tagStatements.append(iStatement);
+    }
+    else
+    {
+        ioFile.hasRating = true;
+        ioFile.rating = iStatement.object().literal().toInt();
+        ioFile.ratingStatement = iStatement;
+    }
+}
+
+bool NepomukCollection::loadTags(const QString &iUrlFilter)
+{
+    QString query = QString("select ?url ?r ?tag ?g ?label where { ?r %1 ?url . graph ?g { ?r %2 ?tag . } OPTIONAL { ?tag %3 ?label . } %4 }")
+        .arg(n3(QUrl(nieUrl)), n3(Soprano::Vocabulary::NAO::hasTag()), n3(Soprano::Vocabulary::NAO::prefLabel()), iUrlFilter);
+    Soprano::QueryResultIterator it = executeQuery(query);
+    while (it.next())
+    {
+        Soprano::Statement statement(it.binding("r"), Soprano::Vocabulary::NAO::hasTag(), it.binding("tag"), it.binding("g"));
+        addStatement(m_snapshot[it.binding("url").uri().toLocalFile()], statement, it.binding("label").literal().toString());
+    }
+    return !mainModel()->lastError();
+}
+
+bool NepomukCollection::loadRatings(const QString &iUrlFilter)
+{
+    QString query = QString("select ?url ?r ?rating ?g where { ?r %1 ?url . graph ?g { ?r %2 ?rating . } %3 }")
+        .arg(n3(QUrl(nieUrl)), n3(Soprano::Vocabulary::NAO::numericRating()), iUrlFilter);
+    Soprano::QueryResultIterator it = executeQuery(query);
+    while (it.next())
+    {
+        Soprano::Statement statement(it.binding("r"), Soprano::Vocabulary::NAO::numericRating(), it.binding("rating"), it.binding("g"));
+        addStatement(m_snapshot[it.binding("url").uri().toLocalFile()], statement, QString());
+    }
+    return !mainModel()->lastError();
+}
+
+// Filter of ?url on the files under iDirectory (only those directly in it if not iRecursive)
+static QString urlFilter(const QString &iDirectory, bool iRecursive = true)
+{
+    QString prefix = QRegExp::escape(QString::fromAscii(QUrl::fromLocalFile(iDirectory + "/").toEncoded()));
+    prefix.replace('\\', "\\\\").replace('"', "\\\"");
+    return QString("FILTER(REGEX(STR(?url), \"^%1%2\"))").arg(prefix, (iRecursive ? "" : "[^/]*$"));
+}
+
+bool NepomukCollection::loadSnapshot(const QString &iDirectory)
+{
+    // Fetch the tags and ratings of every file under iDirectory in two queries, instead of several calls per file
+    m_snapshot.clear();
+    QString filter = urlFilter(iDirectory);
+    if (!loadTags(filter) || !loadRatings(filter))
+    {
+        std::cout << "Error: cannot retrieve Nepomuk snapshot" << std::endl;
+        m_snapshot.clear();
+        return false;
+    }
+
+    m_snapshotDirectory = iDirectory;
+    m_hasSnapshot = true;
+    if (m_isVerbose)
+    {
+        std::cout << "Loaded " << m_snapshot.size() << " Nepomuk files under " << std::string(iDirectory.toLocal8Bit()) << std::endl;
+    }
+    return true;
+}
+
+void NepomukCollection::clearSnapshot()
+{
+    m_hasSnapshot = false;
+    m_snapshot.clear();
+}
+
+// True if iFileName is covered by the snapshot: absence from the snapshot then means no tags and no rating
+bool NepomukCollection::inSnapshot(const QString &iFileName) const
+{
+    return m_hasSnapshot
+        && iFileName.length() > m_snapshotDirectory.length()
+        && iFileName.startsWith(m_snapshotDirectory)
+        && iFileName[m_snapshotDirectory.length()] == '/';
+}
+
+void NepomukCollection::getFile(const QString &iFileName, NepomukFile &oFile, bool iUseSnapshot) const
+{
+    if (iUseSnapshot && inSnapshot(iFileName))
+    {
+        oFile = m_snapshot.value(iFileName);
+        oFile.fileName = iFileName;
+        return;
+    }
+
+    // Resource, tags and rating of the file in one query
+    oFile = NepomukFile();
+    oFile.fileName = iFileName;
+    QString query = QString("select ?r ?p ?o ?g where { ?r %1 %2 . OPTIONAL { graph ?g { ?r ?p ?o . FILTER(?p = %3 || ?p = %4) } } }")
+        .arg(n3(QUrl(nieUrl)), n3(QUrl::fromLocalFile(iFileName)), n3(Soprano::Vocabulary::NAO::hasTag()), n3(Soprano::Vocabulary::NAO::numericRating()));
+    Soprano::QueryResultIterator it = executeQuery(query);
+    while (it.next())
+    {
+        oFile.resourceUri = it.binding("r").uri();
+        if (it.binding("p").isValid())
+        {
+            Soprano::Statement statement(it.binding("r"), it.binding("p"), it.binding("o"), it.binding("g"));
+            bool isTag = (it.binding("p").uri() == Soprano::Vocabulary::NAO::hasTag());
+            addStatement(oFile, statement, (isTag ? tagLabel(it.binding("o").uri()) : QString()));
+        }
+    }
+}
+
+// Called with m_tagMutex locked. If tags cannot be listed, they are looked up one by one.
+void NepomukCollection::loadTagList() const
+{
+    m_hasTagList = true;
+    QString query = QString("select ?tag ?label where { ?tag %1 %2 . ?tag %3 ?label . }")
+        .arg(n3(Soprano::Vocabulary::RDF::type()), n3(Soprano::Vocabulary::NAO::Tag()), n3(Soprano::Vocabulary::NAO::prefLabel()));
+    Soprano::QueryResultIterator it = executeQuery(query);
+    while (it.next())
+    {
+        QUrl uri = it.binding("tag").uri();
+        QString label = it.binding("label").literal().toString();
+        if (!m_tagUris.contains(label))
+        {
+            m_tagUris.insert(label, uri);
+        }
+        m_tagLabels.insert(uri.toString(), label);
+    }
+    if (mainModel()->lastError())
+    {
+        std::cout << "Error: cannot list Nepomuk tags" << std::endl;
+    }
+    else if (m_isVerbose)
+    {
+        std::cout << "Loaded " << m_tagLabels.size() << " Nepomuk tags" << std::endl;
+    }
+}
+
+QString NepomukCollection::tagLabel(const QUrl &iUri) const
+{
+    QMutexLocker locker(&m_tagMutex);
+    if (!m_hasTagList)
+    {
+        loadTagList();
+    }
+    QHash<QString, QString>::const_iterator i = m_tagLabels.constFind(iUri.toString());
+    if (i != m_tagLabels.constEnd())
+    {
+        return i.value();
+    }
+    QString label = Nepomuk::Tag(iUri).label();
+    m_tagLabels.insert(iUri.toString(), label);
+    return label;
+}
+
+QUrl NepomukCollection::tagUri(const QString &iLabel)
+{
+    QMutexLocker locker(&m_tagMutex);
+    if (!m_hasTagList)
+    {
+        loadTagList();
+    }
+    QHash<QString, QUrl>::const_iterator i = m_tagUris.constFind(iLabel);
+    if (i != m_tagUris.constEnd())
+    {
+        return i.value();
+    }
+    Nepomuk::Tag tag(iLabel);
+    tag.setLabel(iLabel);
+    QUrl uri = tag.resourceUri();
+    m_tagUris.insert(iLabel, uri);
+    m_tagLabels.insert(uri.toString(), iLabel);
+    return uri;
+}
+
+bool NepomukCollection::queueChanges(const NepomukFile &iFile, const NepomukChanges &iChanges)
+{
+    if (iChanges.isEmpty())
+    {
+        return true;
+    }
+    QList<QUrl> addedTags;
+    foreach (const QString &label, iChanges.addedTags)
+    {
+        addedTags.append(tagUri(label));
+    }
+    QMutexLocker locker(&m_changesMutex);
+    QUrl resourceUri = iFile.resourceUri;
+    if (resourceUri.isEmpty())
+    {
+        // Nothing to remove: the file has no tags and no rating. Its resource is created by the
+        // batch, unless it already was by changes still pending.
+        resourceUri = m_pendingResources.value(iFile.fileName);
+        if (resourceUri.isEmpty())
+        {
+            resourceUri = Nepomuk::ResourceManager::instance()->generateUniqueUri(QString("file"));
+            m_pendingResources.insert(iFile.fileName, resourceUri);
+            m_pendingAdditions.append(Soprano::Statement(resourceUri, QUrl(nieUrl), QUrl::fromLocalFile(iFile.fileName)));
+            m_pendingAdditions.append(Soprano::Statement(resourceUri, Soprano::Vocabulary::RDF::type(), QUrl(nfoFileDataObject)));
+        }
+    }
+    foreach (int tag, iChanges.removedTags)
+    {
+        m_pendingRemovals.append(iFile.tagStatements[tag]);
+    }
+    foreach (const QUrl &tag, addedTags)
+    {
+        m_pendingAdditions.append(Soprano::Statement(resourceUri, Soprano::Vocabulary::NAO::hasTag(), tag));
+    }
+    if (iFile.hasRating && (iChanges.isRatingRemoved || iChanges.newRating >= 0))
+    {
+        m_pendingRemovals.append(iFile.ratingStatement);
+    }
+    if (iChanges.newRating >= 0)
+    {
+        m_pendingAdditions.append(Soprano::Statement(resourceUri, Soprano::Vocabulary::NAO::numericRating(), Soprano::LiteralValue(iChanges.newRating)));
+    }
+    m_nbPendingFiles++;
+    if (m_nbPendingFiles >= m_batchSize)
+    {
+        return writeBatch();
+    }
+    return true;
+}
+
+// Called with m_changesMutex locked
+bool NepomukCollection::writeBatch()
+{
+    if (m_nbPendingFiles == 0)
+    {
+        return true;
+    }
+    if (m_isVerbose)
+    {
+        std::cout << "Writing changes of " << m_nbPendingFiles << " files to Nepomuk" << std::endl;
+    }
+
+    bool ok = (m_pendingRemovals.isEmpty() || mainModel()->removeStatements(m_pendingRemovals) == Soprano::Error::ErrorNone);
+    if (ok && !m_pendingAdditions.isEmpty())
+    {
+        // As Nepomuk does, new statements are put in a new graph
+        Soprano::NRLModel nrlModel(mainModel());
+        QUrl graph = nrlModel.createGraph(Soprano::Vocabulary::NRL::InstanceBase());
+        QList<Soprano::Statement> additions;
+        foreach (Soprano::Statement statement, m_pendingAdditions)
+        {
+            statement.setContext(graph);
+            additions.append(statement);
+        }
+        ok = !graph.isEmpty() && mainModel()->addStatements(additions) == Soprano::Error::ErrorNone;
+    }
+    m_pendingRemovals.clear();
+    m_pendingAdditions.clear();
+    m_pendingResources.clear();
+    m_nbPendingFiles = 0;
+
+    if (!ok)
+    {
+        std::cout << "Error: cannot write changes to Nepomuk: " << mainModel()->lastError().message().toStdString() << std::endl;
+        m_batchFailed = true;
+    }
+    return ok;
+}
+
+bool NepomukCollection::writePendingChanges()
+{
+    QMutexLocker locker(&m_changesMutex);
+    return writeBatch();
+}
+
+bool NepomukCollection::flushChanges()
+{
+    QMutexLocker locker(&m_changesMutex);
+    writeBatch();
+    bool ok = !m_batchFailed;
+    m_batchFailed = false;
+    return ok;
+}
+
+const NepomukFile& NepomukRequest::file()
+{
+    QMutexLocker locker(&m_mutex);
+    while (!m_isDone)
+    {
+        m_done.wait(&m_mutex);
+    }
+    return m_file;
+}
+
+void NepomukCollection::startRequests(int iWindow)
+{
+    // Requests waiting for a thread are bounded as well
+    m_requests = new BoundedQueue<NepomukRequest*>(iWindow);
+    for (int i=0; i<iWindow; ++i)
+    {
+        m_requestThreads.append(new StageThread<NepomukCollection>(*this, &NepomukCollection::runRequests));
+        m_requestThreads.last()->start();
+    }
+}
+
+NepomukRequest* NepomukCollection::requestFile(const QString &iFileName)
+{
+    if (!m_requests || inSnapshot(iFileName))
+    {
+        return 0;
+    }
+    NepomukRequest* request = new NepomukRequest(iFileName);
+    m_requests->push(request);
+    return request;
+}
+
+void NepomukCollection::runRequests()
+{
+    NepomukRequest* request;
+    while (m_requests->pop(request))
+    {
+        NepomukFile file;
+        getFile(request->m_fileName, file, false);
+        QMutexLocker locker(&request->m_mutex);
+        request->m_file = file;
+        request->m_isDone = true;
+        request->m_done.wakeAll();
+    }
+}
+
+//------------------
+// Metadata store
+
+// Entries of a scan, each grouping the rows of a file (one per tag or rating) as they are received
+class NepomukCursor : public StoreCursor
+{
+public:
+    NepomukCursor(NepomukCollection &iCollection, const Soprano::QueryResultIterator &iIterator)
+        : m_collection(iCollection), m_it(iIterator)
+    {
+        readRow();
+    }
+    bool next(StoreEntry &oEntry)
+    {
+        if (!m_hasRow)
+        {
+            return false;
+        }
+        QUrl url = m_it.binding("url").uri();
+        NepomukFile &file = m_collection.m_scannedFile;
+        file = NepomukFile();
+        file.fileName = url.toLocalFile();
+        while (m_hasRow && m_it.binding("url").uri() == url)
+        {
+            Soprano::Statement statement(m_it.binding("r"), m_it.binding("p"), m_it.binding("o"), m_it.binding("g"));
+            bool isTag = (m_it.binding("p").uri() == Soprano::Vocabulary::NAO::hasTag());
+            addStatement(file, statement, (isTag ? m_it.binding("label").literal().toString() : QString()));
+            readRow();
+        }
+        oEntry = StoreEntry(file.fileName);
+        oEntry.tags = file.tagLabels;
+        oEntry.hasRating = file.hasRating;
+        oEntry.rating = file.rating;
+        return true;
+    }
+private:
+    NepomukCollection &m_collection;
+    Soprano::QueryResultIterator m_it;
+    bool m_hasRow;
+    void readRow()
+    {
+        m_hasRow = m_it.next();
+        if (!m_hasRow && mainModel()->lastError())
+        {
+            std::cout << "Error: cannot read Nepomuk files" << std::endl;
+            m_isError = true;
+        }
+    }
+};
+
+StoreCursor* NepomukCollection::scan(const QString &iDirectory, bool iRecursive)
+{
+    m_scannedFile = NepomukFile();
+    QString query = QString("select ?url ?r ?p ?o ?g ?label where { ?r %1 ?url . graph ?g { ?r ?p ?o . FILTER(?p = %2 || ?p = %3) } OPTIONAL { ?o %4 ?label . } %5 } ORDER BY STR(?url)")
+        .arg(n3(QUrl(nieUrl)), n3(Soprano::Vocabulary::NAO::hasTag()), n3(Soprano::Vocabulary::NAO::numericRating()),
+             n3(Soprano::Vocabulary::NAO::prefLabel()), urlFilter(iDirectory, iRecursive));
+    return new NepomukCursor(*this, executeQuery(query));
+}
+
+bool NepomukCollection::update(const StoreEntry &iOld, const StoreEntry &iNew)
+{
+    // Statements to remove: those of the file last scanned, or else read if the file has any
+    NepomukFile file;
+    if (m_scannedFile.fileName == iOld.fileName)
+    {
+        file = m_scannedFile;
+    }
+    else if (!iOld.tags.isEmpty() || iOld.hasRating)
+    {
+        getFile(iOld.fileName, file, false);
+    }
+    else
+    {
+        file.fileName = iOld.fileName;
+    }
+
+    NepomukChanges changes;
+    for (int i=0; i<file.tagLabels.size(); ++i)
+    {
+        if (!iNew.tags.contains(file.tagLabels[i]))
+        {
+            changes.removedTags.append(i);
+        }
+    }
+    foreach (const QString &tag, iNew.tags)
+    {
+        if (!file.tagLabels.contains(tag))
+        {
+            changes.addedTags.append(tag);
+        }
+    }
+    if (iNew.hasRating)
+    {
+        if (!file.hasRating || file.rating != (unsigned int)iNew.rating)
+        {
+            changes.newRating = iNew.rating;
+        }
+    }
+    else
+    {
+        changes.isRatingRemoved = file.hasRating;
+    }
+    return queueChanges(file, changes);
+}
@@ -0,0 +1,177 @@
+/*
+ * This file is part of Neposync program.
+ * Copyright (C) 2010 Eric Pignet <eric at erixpage dot com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef NEPOMUKCOLLECTION_H
+#define NEPOMUKCOLLECTION_H
+
+#include <QtCore/QHash>
+#include <QtCore/QList>
+#include <QtCore/QMutex>
+#include <QtCore/QString>
+#include <QtCore/QStringList>
+#include <QtCore/QUrl>
+#include <QtCore/QWaitCondition>
+
+#include <Soprano/Statement>
+
+#include "MetadataStore.h"
+#include "Pipeline.h"
+
+// Tags and rating of one file in Nepomuk
+struct NepomukFile
+{
+    QString fileName;
+    // Resource of the file, empty if the file is not in Nepomuk yet
+    QUrl resourceUri;
+    // Tag resources, their labels and their statements (with their graph) in the same order
+    QList<QUrl> tagUris;
+    QStringList tagLabels;
+    QList<Soprano::Statement> tagStatements;
+    bool hasRating;
+    unsigned int rating;
+    Soprano::Statement ratingStatement;
+
+    NepomukFile() : hasRating(false), rating(0) {}
+};
+
+// Changes of one file in Nepomuk
+struct NepomukChanges
+{
+    // Indexes in NepomukFile::tagUris
+    QList<int> removedTags;
+    // Labels, tags being created if needed when the changes are queued
+    QStringList addedTags;
+    bool isRatingRemoved;
+    // -1 if unchanged
+    int newRating;
+
+    NepomukChanges() : isRatingRemoved(false), newRating(-1) {}
+    bool isEmpty() const { return removedTags.isEmpty() && addedTags.isEmpty() && !isRatingRemoved && newRating < 0; }
+};
+
+// Read of the tags and rating of a file, answered by another thread (see NepomukCollection::requestFile)
+class NepomukRequest
+{
+public:
+    NepomukRequest(const QString &iFileName) : m_fileName(iFileName), m_isDone(false) {}
+    // Waits for the reply
+    const NepomukFile& file();
+private:
+    friend class NepomukCollection;
+    QString m_fileName;
+    NepomukFile m_file;
+    bool m_isDone;
+    QMutex m_mutex;
+    QWaitCondition m_done;
+    NepomukRequest(const NepomukRequest&);
+    NepomukRequest& operator=(const NepomukRequest&);
+};
+
+// Tags and ratings of files in Nepomuk.
+//
+// Reading them through Nepomuk::Resource costs several D-Bus calls per file. loadSnapshot() reads
+// those of all files under a directory with one SPARQL query per property, and later reads of these
+// files are answered from memory. The snapshot does not follow changes made in Nepomuk after it was
+// loaded. It is loaded and cleared between passes over the files, when no file is read.
+//
+// Tags are all listed once, the first time one is needed, and kept for the whole run: a tag is
+// then looked up or created once per label, instead of once per file.
+//
+// Changes of files are queued as statements and written by batches of files (one removeStatements
+// and one addStatements call per batch, added statements being put in a new graph). The resource of
+// a file which is not in Nepomuk yet (nie:url and rdf:type statements) is added with the same batch.
+// Tags and changes may be used from several threads.
+//
+// Each Nepomuk call blocks until its reply. With startRequests(), files are read in the background
+// by a window of threads, each with one call in flight, so that the latencies of the reads of
+// several files overlap while other files are processed.
+//
+// As a MetadataStore, the tags and ratings of all files under a directory are read by one query
+// sorted by url, and read as they are received.
+class NepomukCollection : public MetadataStore
+{
+public:
+    NepomukCollection(bool isVerbose = false);
+    ~NepomukCollection();
+    bool loadSnapshot(const QString &iDirectory);
+    // Later reads query Nepomuk
+    void clearSnapshot();
+    // iFileName is an absolute path. With iUseSnapshot false, Nepomuk is queried even if the
+    // file is in the snapshot (the file was changed in Nepomuk since).
+    void getFile(const QString &iFileName, NepomukFile &oFile, bool iUseSnapshot = true) const;
+    // Resource of the tag labelled iLabel, created if there is none
+    QUrl tagUri(const QString &iLabel);
+    void setBatchSize(int iBatchSize) { m_batchSize = iBatchSize; }
+    // Changes of iFile, as read by getFile(), are written when m_batchSize files are pending,
+    // or when writePendingChanges() or flushChanges() is called
+    bool queueChanges(const NepomukFile &iFile, const NepomukChanges &iChanges);
+    // Writes the pending changes now (e.g. to read them back). A failure is still reported by flushChanges().
+    bool writePendingChanges();
+    // At the end of a pass: returns false if any batch could not be written since the last call
+    bool flushChanges();
+    // Reads files with up to iWindow calls in flight
+    void startRequests(int iWindow);
+    // Starts reading a file in the background (iFileName is an absolute path), and returns the request
+    // to delete once answered. Waits while the window is full. Returns 0 if the file is in the
+    // snapshot or if requests were not started: getFile() answers at once then.
+    NepomukRequest* requestFile(const QString &iFileName);
+    // MetadataStore
+    const char* storeName() const { return "Nepomuk"; }
+    bool handles(const QString &) const { return true; }
+    bool handlesTags(const QString &) const { return true; }
+    StoreCursor* scan(const QString &iDirectory, bool iRecursive);
+    bool update(const StoreEntry &iOld, const StoreEntry &iNew);
+    bool flush() { return flushChanges(); }
+protected:
+    bool m_isVerbose;
+    // Snapshot of all files with tags or rating under m_snapshotDirectory, indexed by absolute path
+    bool m_hasSnapshot;
+    QString m_snapshotDirectory;
+    QHash<QString, NepomukFile> m_snapshot;
+    bool inSnapshot(const QString &iFileName) const;
+    bool loadTags(const QString &iUrlFilter);
+    bool loadRatings(const QString &iUrlFilter);
+    // All tags, by label and by resource uri (as a string)
+    mutable QMutex m_tagMutex;
+    mutable bool m_hasTagList;
+    mutable QHash<QString, QUrl> m_tagUris;
+    mutable QHash<QString, QString> m_tagLabels;
+    void loadTagList() const;
+    QString tagLabel(const QUrl &iUri) const;
+    // Write-behind changes
+    QMutex m_changesMutex;
+    int m_batchSize;
+    int m_nbPendingFiles;
+    QList<Soprano::Statement> m_pendingRemovals;
+    QList<Soprano::Statement> m_pendingAdditions;
+    // Resources created by the pending changes, by file name
+    QHash<QString, QUrl> m_pendingResources;
+    bool m_batchFailed;
+    bool writeBatch();
+    // Background reads
+    BoundedQueue<NepomukRequest*>* m_requests;
+    QList<QThread*> m_requestThreads;
+    friend class StageThread<NepomukCollection>;
+    void runRequests();
+    // Last file read by a scan, with its statements: updating it needs no query
+    friend class NepomukCursor;
+    NepomukFile m_scannedFile;
+};
+
+#endif // NEPOMUKCOLLECTION_H
@@ -0,0 +1,115 @@
+/*
+ * This file is part of Neposync program.
+ * Copyright (C) 2010 Eric Pignet <eric at erixpage dot com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <QtCore/QList>
+#include <QtCore/QMutex>
+#include <QtCore/QMutexLocker>
+#include <QtCore/QThread>
+#include <QtCore/QWaitCondition>
+
+// Queue between two stages of a pipeline: push() waits while the queue is full, pop() while it is empty.
+// The depth is sampled at each push, for statistics.
+template <typename T> class BoundedQueue
+{
+public:
+    BoundedQueue(int iCapacity) : m_capacity(iCapacity), m_isClosed(false), m_nbPushed(0), m_depthSum(0), m_maxDepth(0) {}
+    void push(const T &iItem)
+    {
+        QMutexLocker locker(&m_mutex);
+        while (m_items.size() >= m_capacity)
+            m_notFull.wait(&m_mutex);
+        m_items.append(iItem);
+        m_nbPushed++;
+        m_depthSum += m_items.size();
+        m_maxDepth = qMax(m_maxDepth, m_items.size());
+        m_notEmpty.wakeOne();
+    }
+    // Returns false once the queue is closed and empty
+    bool pop(T &oItem)
+    {
+        QMutexLocker locker(&m_mutex);
+        while (m_items.isEmpty() && !m_isClosed)
+            m_notEmpty.wait(&m_mutex);
+        if (m_items.isEmpty())
+            return false;
+        oItem = m_items.takeFirst();
+        m_notFull.wakeOne();
+        return true;
+    }
+    // Nothing more will be pushed: consumers leave once the queue is empty
+    void close()
+    {
+        QMutexLocker locker(&m_mutex);
+        m_isClosed = true;
+        m_notEmpty.wakeAll();
+    }
+    // Opens the queue again, with new statistics
+    void reset()
+    {
+        QMutexLocker locker(&m_mutex);
+        m_isClosed = false;
+        m_nbPushed = 0;
+        m_depthSum = 0;
+        m_maxDepth = 0;
+    }
+    int nbPushed() const
+    {
+        QMutexLocker locker(&m_mutex);
+        return m_nbPushed;
+    }
+    double averageDepth() const
+    {
+        QMutexLocker locker(&m_mutex);
+        return m_nbPushed ? double(m_depthSum) / m_nbPushed : 0;
+    }
+    int maxDepth() const
+    {
+        QMutexLocker locker(&m_mutex);
+        return m_maxDepth;
+    }
+private:
+    mutable QMutex m_mutex;
+    QWaitCondition m_notFull;
+    QWaitCondition m_notEmpty;
+    QList<T> m_items;
+    int m_capacity;
+    bool m_isClosed;
+    int m_nbPushed;
+    qint64 m_depthSum;
+    int m_maxDepth;
+    BoundedQueue(const BoundedQueue&);
+    BoundedQueue& operator=(const BoundedQueue&);
+};
+
+// Thread running one stage of a pipeline, implemented by a method of T
+template <class T> class StageThread : public QThread
+{
+public:
+    StageThread(T &iObject, void (T::*iStage)()) : m_object(iObject), m_stage(iStage) {}
+protected:
+    void run() { (m_object.*m_stage)(); }
+private:
+    T &m_object;
+    void (T::*m_stage)();
+};
+
+#endif // PIPELINE_H
@@ -0,0 +1,465 @@
+/*
+ * This file is part of Neposync program.
+ * Copyright (C) 2010 Eric Pignet <eric at erixpage dot com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "StateCache.h"
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <sys/stat.h>
+
+#include <QtCore/QByteArray>
+#include <QtCore/QDir>
+#include <QtCore/QFileInfo>
+#include <QtCore/QList>
+#include <QtCore/QMutexLocker>
+
+// State file layout:
+//   header:  magic (8 bytes), number of buckets (4), number of entries (4), offset (4) and length (4)
+//            of the root directory
+//   buckets: offset of an entry in the file (4 bytes), 0 if empty. Open addressing, linear probing.
+//   entries: device (8), inode (8), mtime (8), size (8), sidecar mtime (8), synced stores (4),
+//            rating length (2, 0xFFFF if null), number of tags (2), rating, then each tag: length (2), UTF-8 data
+//   root directory: UTF-8 data
+
+static const char stateMagic[8] = { 'N', 'E', 'P', 'O', 'S', 'T', 'A', '2' };
+static const uint headerSize = 24;
+static const uint entryFixedSize = 48;
+static const quint16 nullRating = 0xFFFF;
+
+template <typename T> static T readValue(const uchar* iData)
+{
+    T value;
+    memcpy(&value, iData, sizeof(T));
+    return value;
+}
+
+template <typename T> static void appendValue(QByteArray &ioData, T iValue)
+{
+    ioData.append(reinterpret_cast<const char*>(&iValue), sizeof(T));
+}
+
+bool FileState::sameIdentity(const FileState &iOther) const
+{
+    return device == iOther.device && inode == iOther.inode && mtime == iOther.mtime
+        && size == iOther.size && sidecarMtime == iOther.sidecarMtime;
+}
+
+bool FileState::operator==(const FileState &iOther) const
+{
+    return sameIdentity(iOther) && tags == iOther.tags && rating.isNull() == iOther.rating.isNull()
+        && rating == iOther.rating && syncedStores == iOther.syncedStores;
+}
+
+int StateCache::syncedFlag(Store iStore, bool iForced)
+{
+    // A copy with --force also clears the store when the file is empty: it covers a copy without --force
+    return iForced ? (iStore | (iStore << 1)) : iStore;
+}
+
+bool StateCache::isSynced(const FileState &iState, Store iStore, bool iForced)
+{
+    int flag = syncedFlag(iStore, iForced);
+    return (iState.syncedStores & flag) == flag;
+}
+
+StateCache::StateCache(const QString &iFileName, bool isVerbose)
+    : m_fileName(iFileName), m_isVerbose(isVerbose), m_file(iFileName), m_data(0), m_dataSize(0), m_bucketCount(0)
+{
+}
+
+StateCache::~StateCache()
+{
+    unmapFile();
+}
+
+bool StateCache::load()
+{
+    if (!m_file.exists())
+    {
+        return true;
+    }
+    if (!mapFile())
+    {
+        return false;
+    }
+    if (m_isVerbose)
+    {
+        std::cout << "Loaded state of " << readValue<quint32>(m_data + 12) << " files" << std::endl;
+    }
+    return true;
+}
+
+bool StateCache::mapFile()
+{
+    if (!m_file.open(QIODevice::ReadOnly) || m_file.size() < headerSize)
+    {
+        std::cout << "Error: cannot read state file " << std::string(m_fileName.toLocal8Bit()) << std::endl;
+        m_file.close();
+        return false;
+    }
+    const uchar* data = m_file.map(0, m_file.size());
+    if (!data)
+    {
+        std::cout << "Error: cannot map state file " << std::string(m_fileName.toLocal8Bit()) << std::endl;
+        m_file.close();
+        return false;
+    }
+    quint32 bucketCount = readValue<quint32>(data + 8);
+    quint32 rootOffset = readValue<quint32>(data + 16);
+    quint32 rootLength = readValue<quint32>(data + 20);
+    if (   memcmp(data, stateMagic, sizeof(stateMagic))
+        || bucketCount == 0 || (bucketCount & (bucketCount - 1))
+        || headerSize + 4 * qint64(bucketCount) > m_file.size()
+        || qint64(rootOffset) + rootLength > m_file.size())
+    {
+        std::cout << "Error: invalid state file " << std::string(m_fileName.toLocal8Bit()) << ", all files will be read" << std::endl;
+        m_file.unmap(const_cast<uchar*>(data));
+        m_file.close();
+        return false;
+    }
+    m_data = data;
+    m_dataSize = m_file.size();
+    m_bucketCount = bucketCount;
+    m_root = storedRoot();
+    return true;
+}
+
+void StateCache::unmapFile()
+{
+    if (m_data)
+    {
+        m_file.unmap(const_cast<uchar*>(m_data));
+    }
+    m_file.close();
+    m_data = 0;
+    m_dataSize = 0;
+    m_bucketCount = 0;
+    m_root.clear();
+}
+
+// Fibonacci hashing of the inode, so that consecutive inodes spread over the table
+quint32 StateCache::hash(quint64 iDevice, quint64 iInode)
+{
+    quint64 h = (iInode * Q_UINT64_C(0x9E3779B97F4A7C15)) ^ iDevice;
+    return quint32(h >> 32) ^ quint32(h);
+}
+
+bool StateCache::readEntry(quint32 iOffset, FileState &oState) const
+{
+    if (iOffset < headerSize || iOffset + qint64(entryFixedSize) > m_dataSize)
+    {
+        return false;
+    }
+    const uchar* entry = m_data + iOffset;
+    oState.device = readValue<quint64>(entry);
+    oState.inode = readValue<quint64>(entry + 8);
+    oState.mtime = readValue<qint64>(entry + 16);
+    oState.size = readValue<qint64>(entry + 24);
+    oState.sidecarMtime = readValue<qint64>(entry + 32);
+    oState.syncedStores = readValue<quint32>(entry + 40);
+    quint16 ratingLength = readValue<quint16>(entry + 44);
+    quint16 tagCount = readValue<quint16>(entry + 46);
+
+    qint64 position = iOffset + entryFixedSize;
+    oState.rating.clear();
+    if (ratingLength != nullRating)
+    {
+        if (position + ratingLength > m_dataSize)
+            return false;
+        oState.rating = QString::fromUtf8(reinterpret_cast<const char*>(m_data + position), ratingLength);
+        if (oState.rating.isNull())
+            oState.rating = "";
+        position += ratingLength;
+    }
+    oState.tags.clear();
+    for (int i=0; i<tagCount; ++i)
+    {
+        if (position + 2 > m_dataSize)
+            return false;
+        quint16 length = readValue<quint16>(m_data + position);
+        position += 2;
+        if (position + length > m_dataSize)
+            return false;
+        oState.tags.append(QString::fromUtf8(reinterpret_cast<const char*>(m_data + position), length));
+        position += length;
+    }
+    return true;
+}
+
+// Entry of this run if any, else entry of the state file
+bool StateCache::find(quint64 iDevice, quint64 iInode, FileState &oState) const
+{
+    QHash< QPair<quint64, quint64>, FileState >::const_iterator i = m_updates.constFind(qMakePair(iDevice, iInode));
+    if (i != m_updates.constEnd())
+    {
+        oState = i.value();
+        return true;
+    }
+    if (!m_data)
+    {
+        return false;
+    }
+    quint32 mask = m_bucketCount - 1;
+    quint32 bucket = hash(iDevice, iInode) & mask;
+    for (quint32 probe = 0; probe < m_bucketCount; ++probe, bucket = (bucket + 1) & mask)
+    {
+        quint32 offset = readValue<quint32>(m_data + headerSize + 4 * bucket);
+        if (offset == 0 || offset + qint64(entryFixedSize) > m_dataSize)
+        {
+            return false;
+        }
+        if (   readValue<quint64>(m_data + offset) == iDevice
+            && readValue<quint64>(m_data + offset + 8) == iInode)
+        {
+            return readEntry(offset, oState);
+        }
+    }
+    return false;
+}
+
+bool StateCache::readIdentity(const QString &iFileName, const QString &iSidecarFileName, FileState &oState)
+{
+    struct stat info;
+    if (stat(QFile::encodeName(iFileName).constData(), &info) != 0)
+    {
+        return false;
+    }
+    oState.device = info.st_dev;
+    oState.inode = info.st_ino;
+    oState.mtime = qint64(info.st_mtim.tv_sec) * 1000000000 + info.st_mtim.tv_nsec;
+    oState.size = info.st_size;
+    oState.sidecarMtime = 0;
+    if (!iSidecarFileName.isEmpty() && stat(QFile::encodeName(iSidecarFileName).constData(), &info) == 0)
+    {
+        oState.sidecarMtime = qint64(info.st_mtim.tv_sec) * 1000000000 + info.st_mtim.tv_nsec;
+    }
+    return true;
+}
+
+bool StateCache::lookup(const QString &iFileName, const QString &iSidecarFileName, FileState &oState)
+{
+    FileState current;
+    if (!readIdentity(iFileName, iSidecarFileName, current))
+    {
+        oState = current;
+        return false;
+    }
+    QMutexLocker locker(&m_mutex);
+    if (!m_passDirectory.isNull())
+    {
+        m_seen.insert(qMakePair(current.device, current.inode));
+    }
+    FileState recorded;
+    if (find(current.device, current.inode, recorded) && recorded.sameIdentity(current))
+    {
+        oState = recorded;
+        return true;
+    }
+    oState = current;
+    return false;
+}
+
+void StateCache::update(const QString &iFileName, const QString &iSidecarFileName, FileState &ioState, bool iWritten)
+{
+    if (iWritten && !readIdentity(iFileName, iSidecarFileName, ioState))
+    {
+        return;
+    }
+    if (!ioState.hasIdentity())
+    {
+        return;
+    }
+    QMutexLocker locker(&m_mutex);
+    FileState recorded;
+    if (!find(ioState.device, ioState.inode, recorded) || !(recorded == ioState))
+    {
+        m_updates.insert(qMakePair(ioState.device, ioState.inode), ioState);
+        m_root = commonDirectory(m_root, QDir::cleanPath(QFileInfo(iFileName).absolutePath()));
+    }
+}
+
+void StateCache::discardChanges()
+{
+    QMutexLocker locker(&m_mutex);
+    m_updates.clear();
+    m_root = storedRoot();
+    m_passDirectory = QString();
+    m_seen.clear();
+}
+
+void StateCache::beginFullPass(const QString &iDirectory)
+{
+    QMutexLocker locker(&m_mutex);
+    m_passDirectory = QDir::cleanPath(QFileInfo(iDirectory).absoluteFilePath());
+    m_seen.clear();
+}
+
+void StateCache::markSeen(const QString &iFileName)
+{
+    {
+        QMutexLocker locker(&m_mutex);
+        if (m_passDirectory.isNull())
+        {
+            return;
+        }
+    }
+    struct stat info;
+    if (stat(QFile::encodeName(iFileName).constData(), &info) == 0)
+    {
+        QMutexLocker locker(&m_mutex);
+        m_seen.insert(qMakePair(quint64(info.st_dev), quint64(info.st_ino)));
+    }
+}
+
+// Root directory recorded in the mapped state file
+QString StateCache::storedRoot() const
+{
+    if (!m_data)
+    {
+        return QString();
+    }
+    return QString::fromUtf8(reinterpret_cast<const char*>(m_data + readValue<quint32>(m_data + 16)),
+                             readValue<quint32>(m_data + 20));
+}
+
+// Deepest directory holding both directories (absolute and clean paths, iDirectory1 may be empty)
+QString StateCache::commonDirectory(const QString &iDirectory1, const QString &iDirectory2)
+{
+    if (iDirectory1.isEmpty())
+    {
+        return iDirectory2;
+    }
+    QString directory = iDirectory1;
+    while (   directory != "/" && directory != iDirectory2
+           && !iDirectory2.startsWith(directory.endsWith('/') ? directory : directory + '/'))
+    {
+        directory = QFileInfo(directory).path();
+    }
+    return directory;
+}
+
+// Writes all entries in a new state file, which then replaces the previous one.
+// After a full pass over a directory holding all the files, entries of files not seen are dropped.
+bool StateCache::save()
+{
+    QMutexLocker locker(&m_mutex);
+    bool isPruned =    !m_passDirectory.isNull()
+                    && (   m_root.isEmpty() || m_passDirectory == "/" || m_root == m_passDirectory
+                        || m_root.startsWith(m_passDirectory + '/'));
+    m_passDirectory = QString();
+
+    QList<FileState> entries;
+    int nbDropped = 0;
+    for (quint32 bucket = 0; bucket < m_bucketCount; ++bucket)
+    {
+        quint32 offset = readValue<quint32>(m_data + headerSize + 4 * bucket);
+        FileState state;
+        if (offset != 0 && readEntry(offset, state) && !m_updates.contains(qMakePair(state.device, state.inode)))
+        {
+            if (isPruned && !m_seen.contains(qMakePair(state.device, state.inode)))
+            {
+                nbDropped++;
+                continue;
+            }
+            entries.append(state);
+        }
+    }
+    m_seen.clear();
+    if (m_updates.isEmpty() && nbDropped == 0)
+    {
+        return true;
+    }
+    entries += m_updates.values();
+
+    // Table filled at most by half
+    quint32 bucketCount = 16;
+    while (bucketCount < 2 * quint32(entries.size()))
+    {
+        bucketCount *= 2;
+    }
+    QByteArray data(stateMagic, sizeof(stateMagic));
+    appendValue<quint32>(data, bucketCount);
+    appendValue<quint32>(data, entries.size());
+    appendValue<quint32>(data, 0);
+    appendValue<quint32>(data, 0);
+    data.append(QByteArray(4 * bucketCount, '\0'));
+
+    foreach (const FileState &state, entries)
+    {
+        quint32 offset = data.size();
+        appendValue<quint64>(data, state.device);
+        appendValue<quint64>(data, state.inode);
+        appendValue<qint64>(data, state.mtime);
+        appendValue<qint64>(data, state.size);
+        appendValue<qint64>(data, state.sidecarMtime);
+        appendValue<quint32>(data, state.syncedStores);
+        QByteArray rating = state.rating.toUtf8();
+        appendValue<quint16>(data, state.rating.isNull() ? nullRating : quint16(rating.size()));
+        appendValue<quint16>(data, state.tags.size());
+        data.append(rating);
+        foreach (const QString &tag, state.tags)
+        {
+            QByteArray utf8Tag = tag.toUtf8();
+            appendValue<quint16>(data, utf8Tag.size());
+            data.append(utf8Tag);
+        }
+
+        quint32 mask = bucketCount - 1;
+        quint32 bucket = hash(state.device, state.inode) & mask;
+        while (readValue<quint32>(reinterpret_cast<const uchar*>(data.constData()) + headerSize + 4 * bucket) != 0)
+        {
+            bucket = (bucket + 1) & mask;
+        }
+        memcpy(data.data() + headerSize + 4 * bucket, &offset, sizeof(offset));
+    }
+    QByteArray root = m_root.toUtf8();
+    quint32 rootOffset = data.size();
+    quint32 rootLength = root.size();
+    memcpy(data.data() + 16, &rootOffset, sizeof(rootOffset));
+    memcpy(data.data() + 20, &rootLength, sizeof(rootLength));
+    data.append(root);
+
+    QString newFileName = m_fileName + ".new";
+    QFile newFile(newFileName);
+    if (   !newFile.open(QIODevice::WriteOnly | QIODevice::Truncate)
+        || newFile.write(data) != data.size()
+        || !newFile.flush())
+    {
+        std::cout << "Error: cannot write state file " << std::string(newFileName.toLocal8Bit()) << std::endl;
+        newFile.remove();
+        return false;
+    }
+    newFile.close();
+    if (rename(QFile::encodeName(newFileName).constData(), QFile::encodeName(m_fileName).constData()) != 0)
+    {
+        std::cout << "Error: cannot replace state file " << std::string(m_fileName.toLocal8Bit()) << std::endl;
+        return false;
+    }
+    if (m_isVerbose)
+    {
+        std::cout << "Saved state of " << entries.size() << " files (" << m_updates.size() << " changed, "
+                  << nbDropped << " dropped)" << std::endl;
+    }
+
+    // Later lookups use the new file
+    unmapFile();
+    m_updates.clear();
+    return mapFile();
+}
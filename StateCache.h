@@ -0,0 +1,116 @@
+/*
+ * This file is part of Neposync program.
+ * Copyright (C) 2010 Eric Pignet <eric at erixpage dot com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef STATECACHE_H
+#define STATECACHE_H
+
+#include <QtCore/QFile>
+#include <QtCore/QHash>
+#include <QtCore/QMutex>
+#include <QtCore/QPair>
+#include <QtCore/QSet>
+#include <QtCore/QString>
+#include <QtCore/QStringList>
+
+// Metadata of a file as it was when last synchronized, and the identity of the file at that time
+struct FileState
+{
+    quint64 device;
+    quint64 inode;
+    qint64 mtime;        // nanoseconds
+    qint64 size;
+    qint64 sidecarMtime; // 0 if there is no sidecar file, or if sidecars are not used
+    // Tags and rating read from or written to the file (rating is null if none)
+    QStringList tags;
+    QString rating;
+    // Stores the file metadata was copied to, see StateCache::syncedFlag
+    int syncedStores;
+
+    FileState() : device(0), inode(0), mtime(0), size(0), sidecarMtime(0), syncedStores(0) {}
+    bool hasIdentity() const { return device != 0 || inode != 0; }
+    bool sameIdentity(const FileState &iOther) const;
+    bool operator==(const FileState &iOther) const;
+};
+
+// Persistent state of the files of previous runs (--state FILE), keyed by device and inode.
+// A file whose device, inode, modification time and size did not change still has the recorded
+// metadata, so it does not need to be opened again.
+//
+// The state file is a hash table mapped in memory: lookups do not load it. Changes of the run are
+// kept in memory and written with the previous entries by save(), in a new file which replaces the
+// previous one. Integers are stored in native byte order: the file is not meant to be shared
+// between machines. All methods may be called from several threads.
+//
+// The state file also records a directory holding all its files. After a full pass over this
+// directory (or a parent), save() drops the entries of the files which were not seen during the pass:
+// files deleted or moved out since.
+class StateCache
+{
+public:
+    enum Store { Nepomuk = 0x1, Amarok = 0x4 };
+    // Flag of FileState::syncedStores recording that a file was copied to iStore (with --force or not)
+    static int syncedFlag(Store iStore, bool iForced);
+    static bool isSynced(const FileState &iState, Store iStore, bool iForced);
+
+    StateCache(const QString &iFileName, bool isVerbose = false);
+    ~StateCache();
+    // A missing state file is an empty state
+    bool load();
+    bool save();
+    // Forgets the changes recorded since the last save()
+    void discardChanges();
+    // Until the next save(), all files under iDirectory (recursively) are looked up or marked as seen
+    void beginFullPass(const QString &iDirectory);
+    // During a full pass, records that a file which is not looked up still exists
+    void markSeen(const QString &iFileName);
+    // Fills the current identity of the file in oState, and returns true with the recorded metadata
+    // if the file did not change since. iSidecarFileName is empty if sidecars are not used.
+    bool lookup(const QString &iFileName, const QString &iSidecarFileName, FileState &oState);
+    // Records the metadata of a file. If the file was written, its identity is read again.
+    void update(const QString &iFileName, const QString &iSidecarFileName, FileState &ioState, bool iWritten);
+protected:
+    QString m_fileName;
+    bool m_isVerbose;
+    QMutex m_mutex;
+    // Mapped state file
+    QFile m_file;
+    const uchar* m_data;
+    qint64 m_dataSize;
+    quint32 m_bucketCount;
+    // Entries recorded during this run
+    QHash< QPair<quint64, quint64>, FileState > m_updates;
+    // Directory holding all the files of the entries (absolute, empty if there is none)
+    QString m_root;
+    // Directory of the current full pass if any, and files seen during it
+    QString m_passDirectory;
+    QSet< QPair<quint64, quint64> > m_seen;
+    QString storedRoot() const;
+    static QString commonDirectory(const QString &iDirectory1, const QString &iDirectory2);
+    bool mapFile();
+    void unmapFile();
+    static bool readIdentity(const QString &iFileName, const QString &iSidecarFileName, FileState &oState);
+    static quint32 hash(quint64 iDevice, quint64 iInode);
+    bool find(quint64 iDevice, quint64 iInode, FileState &oState) const;
+    bool readEntry(quint32 iOffset, FileState &oState) const;
+private:
+    StateCache(const StateCache&);
+    StateCache& operator=(const StateCache&);
+};
+
+#endif // STATECACHE_H
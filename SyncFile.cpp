@@ -0,0 +1,128 @@
+/*
+ * This file is part of Neposync program.
+ * Copyright (C) 2010 Eric Pignet <eric at erixpage dot com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "SyncFile.h"
+
+#include <iostream>
+
+#include <QtCore/QMutex>
+#include <QtCore/QMutexLocker>
+
+#include "ID3Utilities.h"
+#include "ImageMetadata.h"
+#include "NepomukCollection.h"
+
+// Buffered reports of different files are printed one at a time
+static QMutex outputMutex;
+
+FileReport::FileReport(const QString &iFileName, bool isVerbose, bool isBuffered)
+    : m_fileName(iFileName), m_fileDisplayed(false), m_isBuffered(isBuffered)
+{
+    if (isVerbose)
+    {
+        out();
+    }
+}
+
+FileReport::~FileReport()
+{
+    if (m_isBuffered && m_fileDisplayed)
+    {
+        QMutexLocker locker(&outputMutex);
+        std::cout << m_buffer.str();
+        std::cout.flush();
+    }
+}
+
+std::ostream& FileReport::out()
+{
+    std::ostream& stream = (m_isBuffered ? static_cast<std::ostream&>(m_buffer) : std::cout);
+    if (!m_fileDisplayed)
+    {
+        stream << "File: " << QString(m_fileName.toLocal8Bit()).toStdString() << std::endl;
+        m_fileDisplayed = true;
+    }
+    return stream;
+}
+
+void FileReport::append(std::ostringstream &ioLines)
+{
+    if (!ioLines.str().empty())
+    {
+        out() << ioLines.str();
+        ioLines.str("");
+    }
+}
+
+SyncFile::~SyncFile()
+{
+    if (nepomukRequest)
+    {
+        nepomukRequest->file();
+        delete nepomukRequest;
+    }
+    delete m_image;
+    delete m_id3;
+}
+
+ImageMetadata& SyncFile::image()
+{
+    if (!m_image)
+    {
+        m_image = new ImageMetadata(fileName(), m_useSidecar);
+        // The file is not read if it did not change since the previous run
+        if (isStateKnown)
+        {
+            m_image->setKnownValues(state.tags, state.rating);
+        }
+    }
+    return *m_image;
+}
+
+int SyncFile::id3Rating()
+{
+    if (newID3Rating >= 0)
+    {
+        return newID3Rating;
+    }
+    int rating = id3().rating();
+    m_report.append(m_id3Output);
+    return rating;
+}
+
+bool SyncFile::writeID3Rating()
+{
+    bool isWritten = id3().setRating(newID3Rating);
+    m_report.append(m_id3Output);
+    return isWritten;
+}
+
+bool SyncFile::hasImageChanges() const
+{
+    return m_image && m_image->changeCount() > 0;
+}
+
+ID3Session& SyncFile::id3()
+{
+    if (!m_id3)
+    {
+        m_id3 = new ID3Session(fileName(), m_isVerbose, m_id3Output);
+    }
+    return *m_id3;
+}
@@ -0,0 +1,103 @@
+/*
+ * This file is part of Neposync program.
+ * Copyright (C) 2010 Eric Pignet <eric at erixpage dot com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef SYNCFILE_H
+#define SYNCFILE_H
+
+#include <ostream>
+#include <sstream>
+
+#include <QtCore/QFileInfo>
+#include <QtCore/QList>
+#include <QtCore/QString>
+
+#include "ChangePlan.h"
+#include "StateCache.h"
+
+class ID3Session;
+class ImageMetadata;
+class NepomukRequest;
+
+// Output about one file: the file name is displayed before the first line about the file, or at once in verbose mode.
+// When files are processed in parallel, the output is buffered and printed at once when the file is done,
+// so that lines about different files are not interleaved.
+class FileReport
+{
+public:
+    FileReport(const QString &iFileName, bool isVerbose, bool isBuffered);
+    ~FileReport();
+    std::ostream& out();
+    // Moves lines collected for this file (e.g. by ID3Session) to the report
+    void append(std::ostringstream &ioLines);
+private:
+    QString m_fileName;
+    bool m_fileDisplayed;
+    bool m_isBuffered;
+    std::ostringstream m_buffer;
+};
+
+// One file being synchronized. Its metadata and its recorded state are read at most once whatever
+// the number of actions, and each action sees the changes made by the previous ones.
+// Changes to the file are written once all actions are done.
+class SyncFile
+{
+public:
+    // State recorded by a previous run (see StateCache), valid if isStateKnown: the file did not change since.
+    // Actions keep it up to date as they read and change the file.
+    bool isStateKnown;
+    FileState state;
+    // MP3 rating to write, -1 if unchanged
+    int newID3Rating;
+    // True once an action changed the file in Nepomuk: the Nepomuk snapshot is then outdated for this file
+    bool isNepomukChanged;
+    // Read of the file in Nepomuk started in the background, if any
+    NepomukRequest* nepomukRequest;
+    // With --plan, changes of all actions, written to the plan once all actions are done
+    QList<PlannedChange> plannedChanges;
+
+    SyncFile(const QFileInfo &iFile, bool iUseSidecar, bool isVerbose, bool isBuffered)
+        : isStateKnown(false), newID3Rating(-1), isNepomukChanged(false), nepomukRequest(0), m_info(iFile), m_useSidecar(iUseSidecar), m_isVerbose(isVerbose),
+          m_report(iFile.filePath(), isVerbose, isBuffered), m_image(0), m_id3(0) {}
+    ~SyncFile();
+    const QFileInfo& info() const { return m_info; }
+    QString fileName() const { return m_info.filePath(); }
+    std::ostream& out() { return m_report.out(); }
+    // Metadata is loaded once, and tags and rating are written together
+    ImageMetadata& image();
+    // MP3 rating, including the change not written yet
+    int id3Rating();
+    // Writes newID3Rating to the file
+    bool writeID3Rating();
+    bool hasImageChanges() const;
+    bool hasChanges() const { return hasImageChanges() || newID3Rating >= 0; }
+private:
+    // The file is parsed once, for reading and writing. Its messages are collected, then moved to the report.
+    ID3Session& id3();
+    QFileInfo m_info;
+    bool m_useSidecar;
+    bool m_isVerbose;
+    FileReport m_report;
+    ImageMetadata* m_image;
+    ID3Session* m_id3;
+    std::ostringstream m_id3Output;
+    SyncFile(const SyncFile&);
+    SyncFile& operator=(const SyncFile&);
+};
+
+#endif // SYNCFILE_H
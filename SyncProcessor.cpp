@@ -0,0 +1,830 @@
+/*
+ * This file is part of Neposync program.
+ * Copyright (C) 2010 Eric Pignet <eric at erixpage dot com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "SyncProcessor.h"
+
+#include <iostream>
+
+#include "AmarokCollection.h"
+#include "FileStore.h"
+#include "ImageMetadata.h"
+
+// Files waiting between two stages of the pipeline
+static const int pipelineQueueSize = 64;
+
+SyncProcessor::SyncProcessor(const QList<Action> &iActions, bool iForceCopy, bool iUseSidecar, bool isVerbose, bool isBuffered,
+                             NepomukCollection* iNepomuk, AmarokCollection* iAmarokDb, StateCache* iStateCache)
+    : m_actions(iActions), m_forceCopy(iForceCopy), m_useSidecar(iUseSidecar), m_isVerbose(isVerbose), m_isBuffered(isBuffered),
+      m_nepomuk(iNepomuk), m_amarokDb(iAmarokDb), m_stateCache(iStateCache), m_plan(0), m_nbFilesWritten(0), m_nbRewritesSaved(0),
+      m_nbSyncJobs(0), m_syncQueue(pipelineQueueSize), m_writeQueue(pipelineQueueSize), m_writeThread(0), m_nbFilesDone(0)
+{
+}
+
+void SyncProcessor::processFile(const QFileInfo &iFile)
+{
+    SyncFile* file = readFile(iFile);
+    if (!file)
+    {
+        return;
+    }
+    if (m_nbSyncJobs > 0)
+    {
+        m_syncQueue.push(file);
+        return;
+    }
+    syncFile(*file);
+    writeFile(*file);
+    delete file;
+}
+
+void SyncProcessor::beginFullPass(const QString &iDirectory)
+{
+    if (m_stateCache)
+    {
+        m_stateCache->beginFullPass(iDirectory);
+    }
+}
+
+bool SyncProcessor::isHandled(const QFileInfo &iFile) const
+{
+    if (FileStore::isMP3(iFile.fileName()))
+    {
+        return true;
+    }
+    if (FileStore::isImage(iFile.fileName()))
+    {
+        foreach (Action action, m_actions)
+        {
+            if (action != AmarokToFiles && action != FilesToAmarok)
+            {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+void SyncProcessor::recordState(SyncFile &ioFile)
+{
+    if (m_stateCache)
+    {
+        if (!ioFile.hasChanges() && !m_plan)
+        {
+            m_stateCache->update(ioFile.fileName(), stateSidecarFileName(ioFile.info()), ioFile.state, false);
+        }
+        ioFile.isStateKnown = true;
+    }
+}
+
+void SyncProcessor::recordID3State(SyncFile &ioFile, int iNewRating)
+{
+    bool isChanged = (iNewRating >= 0);
+    if (isChanged)
+    {
+        planChange(ioFile, PlannedChange::FileRating, (ioFile.isStateKnown ? ioFile.state.rating.toInt() : ioFile.id3Rating()), iNewRating);
+        ioFile.newID3Rating = iNewRating;
+    }
+    if (m_stateCache && (!ioFile.isStateKnown || isChanged))
+    {
+        ioFile.state.rating = QString::number(ioFile.id3Rating());
+        if (isChanged)
+        {
+            ioFile.state.syncedStores = 0;
+        }
+        recordState(ioFile);
+    }
+}
+
+void SyncProcessor::readNepomuk(SyncFile &iFile, NepomukFile &oNepomukFile)
+{
+    if (iFile.isNepomukChanged)
+    {
+        // The changes of an earlier action must be read back (a failed batch is reported at the end of the pass)
+        m_nepomuk->writePendingChanges();
+    }
+    else if (iFile.nepomukRequest)
+    {
+        oNepomukFile = iFile.nepomukRequest->file();
+        return;
+    }
+    m_nepomuk->getFile(iFile.info().absoluteFilePath(), oNepomukFile, !iFile.isNepomukChanged);
+}
+
+void SyncProcessor::writeNepomuk(SyncFile &ioFile, const NepomukFile &iNepomukFile, const NepomukChanges &iChanges)
+{
+    if (iChanges.isEmpty())
+    {
+        return;
+    }
+    if (m_plan)
+    {
+        planNepomuk(ioFile, iNepomukFile, iChanges);
+        return;
+    }
+    m_nepomuk->queueChanges(iNepomukFile, iChanges);
+    ioFile.isNepomukChanged = true;
+}
+
+bool SyncProcessor::writeAmarok(SyncFile &ioFile, int iOldRating, int iNewRating)
+{
+    if (m_plan)
+    {
+        planChange(ioFile, PlannedChange::AmarokRating, iOldRating, iNewRating);
+        return true;
+    }
+    if (!m_amarokDb->queueRating(ioFile.fileName(), iNewRating))
+    {
+        ioFile.out() << "  Cannot write Amarok rating" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void SyncProcessor::planChange(SyncFile &ioFile, PlannedChange::Field iField, const QVariant &iOldValue, const QVariant &iNewValue)
+{
+    if (!m_plan)
+    {
+        return;
+    }
+    QList<PlannedChange> &changes = ioFile.plannedChanges;
+    for (int i=0; i<changes.size(); ++i)
+    {
+        if (changes[i].field == iField)
+        {
+            changes[i].newValue = iNewValue;
+            if (changes[i].newValue == changes[i].oldValue)
+            {
+                changes.removeAt(i);
+            }
+            return;
+        }
+    }
+    PlannedChange change;
+    change.fileName = ioFile.info().absoluteFilePath();
+    change.field = iField;
+    change.oldValue = iOldValue;
+    change.newValue = iNewValue;
+    changes.append(change);
+}
+
+QString SyncProcessor::stateSidecarFileName(const QFileInfo &iFile) const
+{
+    return (m_useSidecar && FileStore::isImage(iFile.fileName())) ? ImageMetadata::sidecarFileName(iFile.filePath()) : QString();
+}
+
+// Records the changes of the file in Nepomuk as the resulting tags and rating
+void SyncProcessor::planNepomuk(SyncFile &ioFile, const NepomukFile &iNepomukFile, const NepomukChanges &iChanges)
+{
+    if (!iChanges.removedTags.isEmpty() || !iChanges.addedTags.isEmpty())
+    {
+        QStringList tags;
+        for (int i=0; i<iNepomukFile.tagLabels.size(); ++i)
+        {
+            if (!iChanges.removedTags.contains(i))
+            {
+                tags.append(iNepomukFile.tagLabels[i]);
+            }
+        }
+        tags += iChanges.addedTags;
+        planChange(ioFile, PlannedChange::NepomukTags, iNepomukFile.tagLabels, tags);
+    }
+    if (iChanges.isRatingRemoved || iChanges.newRating >= 0)
+    {
+        QVariant oldRating = (iNepomukFile.hasRating ? QVariant((int)iNepomukFile.rating) : QVariant());
+        QVariant newRating = (iChanges.newRating >= 0 ? QVariant(iChanges.newRating) : QVariant());
+        planChange(ioFile, PlannedChange::NepomukRating, oldRating, newRating);
+    }
+}
+
+//------------------
+// Nepomuk to files
+
+void SyncProcessor::nepomukToFiles(SyncFile &ioFile)
+{
+    if (FileStore::isImage(ioFile.info().fileName()))
+    {
+        NepomukFile aFile;
+        readNepomuk(ioFile, aFile);
+        ImageMetadata &image = ioFile.image();
+        FileState &state = ioFile.state;
+        bool isKnown = ioFile.isStateKnown;
+
+        // Copy of tags
+        if (!aFile.tagLabels.isEmpty() || m_forceCopy)
+        {
+            QStringList oldKeywords = image.keywords();
+            QStringList newKeywords = aFile.tagLabels;
+            QStringList oldKeywordsSorted(oldKeywords);
+            QStringList newKeywordsSorted(newKeywords);
+            oldKeywordsSorted.sort();
+            newKeywordsSorted.sort();
+            if (oldKeywordsSorted != newKeywordsSorted)
+            {
+                ioFile.out() << "  Needs to replace IPTC keywords to: ";
+                foreach (QString keyword, newKeywords) ioFile.out() << keyword.toStdString() << " ";
+                ioFile.out() << std::endl;
+                planChange(ioFile, PlannedChange::FileTags, oldKeywords, newKeywordsSorted);
+                image.setKeywords(oldKeywords, newKeywordsSorted);
+            }
+        }
+
+        // Copy of rating
+        if (aFile.hasRating)
+        {
+            QString rating = image.rating();
+            if (rating.isNull() || rating.toUInt() != aFile.rating)
+            {
+                ioFile.out() << "  Needs to copy rating: " << QString::number(aFile.rating).toStdString() << std::endl;
+                planChange(ioFile, PlannedChange::FileRating, PlannedChange::ratingValue(rating), (int)aFile.rating);
+                image.setRating(QString::number(aFile.rating));
+            }
+        }
+        else if (m_forceCopy)
+        {
+            QString rating = image.rating();
+            if (!rating.isNull())
+            {
+                ioFile.out() << "  Needs to clear rating" << std::endl;
+                planChange(ioFile, PlannedChange::FileRating, PlannedChange::ratingValue(rating), QVariant());
+                image.setRating(QString());
+            }
+        }
+
+        bool isChanged = (image.changeCount() > 0);
+        if (m_stateCache && (!isKnown || isChanged))
+        {
+            state.tags = image.keywords();
+            state.rating = image.rating();
+            if (isChanged)
+            {
+                state.syncedStores = 0;
+            }
+            recordState(ioFile);
+        }
+    }
+    else if (FileStore::isMP3(ioFile.info().fileName()))
+    {
+        NepomukFile aFile;
+        readNepomuk(ioFile, aFile);
+
+        // The file is not parsed at all if it did not change since the previous run
+        FileState &state = ioFile.state;
+        bool isKnown = ioFile.isStateKnown;
+        int newRating = -1;
+        if (aFile.hasRating)
+        {
+            int id3rating = (isKnown ? state.rating.toInt() : ioFile.id3Rating());
+            if ((unsigned int)id3rating != aFile.rating)
+            {
+                ioFile.out() << "  Needs to copy rating: " << aFile.rating << "/10" << std::endl;
+                newRating = aFile.rating;
+            }
+        }
+        else if (m_forceCopy)
+        {
+            int id3rating = (isKnown ? state.rating.toInt() : ioFile.id3Rating());
+            if (id3rating > 0)
+            {
+                ioFile.out() << "  Needs to clear rating" << std::endl;
+                newRating = 0;
+            }
+        }
+        recordID3State(ioFile, newRating);
+    }
+}
+
+//------------------
+// Files to Nepomuk
+
+void SyncProcessor::filesToNepomuk(SyncFile &ioFile)
+{
+    if (FileStore::isImage(ioFile.info().fileName()))
+    {
+        // Nothing to do if the file did not change since it was copied to Nepomuk
+        FileState &state = ioFile.state;
+        if (ioFile.isStateKnown && StateCache::isSynced(state, StateCache::Nepomuk, m_forceCopy))
+        {
+            return;
+        }
+        ImageMetadata &image = ioFile.image();
+        NepomukFile nepomukFile;
+        readNepomuk(ioFile, nepomukFile);
+        NepomukChanges changes;
+
+        // Copy of tags
+        QStringList keywords = image.keywords();
+        if (!keywords.isEmpty() || m_forceCopy)
+        {
+            // Remove unneeded tags, if any (more performant than removing everything then recreating)
+            for (int i=0; i<nepomukFile.tagUris.size(); ++i)
+            {
+                if (!keywords.contains(nepomukFile.tagLabels[i]))
+                {
+                    ioFile.out() << "  Needs to remove tag: " << nepomukFile.tagLabels[i].toStdString() << std::endl;
+                    changes.removedTags.append(i);
+                }
+            }
+
+            // Add missing tags, each tag being created once for all files
+            foreach (const QString& keyword, keywords)
+            {
+                if (!nepomukFile.tagLabels.contains(keyword))
+                {
+                    ioFile.out() << "  Needs to add tag: " << QString(keyword.toLocal8Bit()).toStdString() << std::endl;
+                    changes.addedTags.append(keyword);
+                }
+            }
+        }
+
+        // Copy of rating
+        QString rating = image.rating();
+        if (!rating.isNull())
+        {
+            if (!nepomukFile.hasRating || rating.toUInt() != nepomukFile.rating)
+            {
+                ioFile.out() << "  Needs to replace rating: " << rating.toStdString() << std::endl;
+                changes.newRating = rating.toUInt();
+            }
+        }
+        else if (m_forceCopy)
+        {
+            if (nepomukFile.hasRating)
+            {
+                ioFile.out() << "  Needs to clear rating" << std::endl;
+                changes.isRatingRemoved = true;
+            }
+        }
+        writeNepomuk(ioFile, nepomukFile, changes);
+
+        state.tags = keywords;
+        state.rating = rating;
+        state.syncedStores |= StateCache::syncedFlag(StateCache::Nepomuk, m_forceCopy);
+        recordState(ioFile);
+    }
+    else if (FileStore::isMP3(ioFile.info().fileName()))
+    {
+        // Nothing to do if the file did not change since it was copied to Nepomuk
+        FileState &state = ioFile.state;
+        bool isKnown = ioFile.isStateKnown;
+        if (isKnown && StateCache::isSynced(state, StateCache::Nepomuk, m_forceCopy))
+        {
+            return;
+        }
+
+        int id3rating = 0;
+        if (isKnown)
+        {
+            id3rating = state.rating.toInt();
+        }
+        else
+        {
+            id3rating = ioFile.id3Rating();
+        }
+        NepomukFile nepomukFile;
+        readNepomuk(ioFile, nepomukFile);
+        NepomukChanges changes;
+        if (id3rating > 0)
+        {
+            if (!nepomukFile.hasRating || ((unsigned int)id3rating != nepomukFile.rating))
+            {
+                ioFile.out() << "  Needs to replace rating: " << id3rating << std::endl;
+                changes.newRating = id3rating;
+            }
+        }
+        else if (m_forceCopy)
+        {
+            if (nepomukFile.hasRating)
+            {
+                ioFile.out() << "  Needs to clear rating" << std::endl;
+                changes.isRatingRemoved = true;
+            }
+        }
+        writeNepomuk(ioFile, nepomukFile, changes);
+
+        state.rating = QString::number(id3rating);
+        state.syncedStores |= StateCache::syncedFlag(StateCache::Nepomuk, m_forceCopy);
+        recordState(ioFile);
+    }
+}
+
+//------------------
+// Display Nepomuk
+
+void SyncProcessor::displayNepomuk(SyncFile &ioFile)
+{
+    if (FileStore::isImage(ioFile.info().fileName()))
+    {
+        NepomukFile aFile;
+        readNepomuk(ioFile, aFile);
+
+        // Display tags
+        if (!aFile.tagLabels.isEmpty())
+        {
+            ioFile.out() << "  Tags:";
+            foreach (const QString &label, aFile.tagLabels)
+            {
+                ioFile.out() << " " << QString(label.toLocal8Bit()).toStdString();
+            }
+            ioFile.out() << std::endl;
+        }
+
+        // Display rating
+        if (aFile.hasRating)
+        {
+            ioFile.out() << "  Rating: " << aFile.rating << std::endl;
+        }
+    }
+    else if (FileStore::isMP3(ioFile.info().fileName()))
+    {
+        NepomukFile aFile;
+        readNepomuk(ioFile, aFile);
+        if (aFile.hasRating)
+        {
+            ioFile.out() << "  Rating: " << aFile.rating << std::endl;
+        }
+    }
+}
+
+//------------------
+// Clear Nepomuk
+
+void SyncProcessor::clearNepomuk(SyncFile &ioFile)
+{
+    if (FileStore::isImage(ioFile.info().fileName()) || FileStore::isMP3(ioFile.info().fileName()))
+    {
+        NepomukFile nepomukFile;
+        readNepomuk(ioFile, nepomukFile);
+        NepomukChanges changes;
+
+        // Clear tags
+        if (!nepomukFile.tagUris.isEmpty())
+        {
+            ioFile.out() << "  Remove tags:";
+            for (int i=0; i<nepomukFile.tagUris.size(); ++i)
+            {
+                ioFile.out() << " " << nepomukFile.tagLabels[i].toStdString();
+                changes.removedTags.append(i);
+            }
+            ioFile.out() << std::endl;
+        }
+
+        // Clear rating
+        if (nepomukFile.hasRating)
+        {
+            ioFile.out() << "  Clear rating" << std::endl;
+            changes.isRatingRemoved = true;
+        }
+        writeNepomuk(ioFile, nepomukFile, changes);
+
+        // The file must be copied to Nepomuk again by the next -fn
+        FileState &state = ioFile.state;
+        if (ioFile.isStateKnown && (state.syncedStores & StateCache::syncedFlag(StateCache::Nepomuk, true)))
+        {
+            state.syncedStores &= ~StateCache::syncedFlag(StateCache::Nepomuk, true);
+            recordState(ioFile);
+        }
+    }
+}
+
+//------------------
+// Amarok to Files
+
+void SyncProcessor::amarokToFiles(SyncFile &ioFile)
+{
+    QString currentFileName(ioFile.fileName());
+
+    if (FileStore::isMP3(ioFile.info().fileName()))
+    {
+        bool urlPresent = false;
+        int amarokRating = 0;
+        m_amarokDb->getRating(currentFileName, urlPresent, amarokRating);
+        // The file is not parsed at all if it did not change since the previous run
+        FileState &state = ioFile.state;
+        bool isKnown = ioFile.isStateKnown;
+        int newRating = -1;
+        if (amarokRating > 0)
+        {
+            int id3rating = (isKnown ? state.rating.toInt() : ioFile.id3Rating());
+            if (id3rating != amarokRating)
+            {
+                ioFile.out() << "  Needs to copy rating: " << amarokRating << "/10" << std::endl;
+                newRating = amarokRating;
+            }
+        }
+        else if (m_forceCopy)
+        {
+            int id3rating = (isKnown ? state.rating.toInt() : ioFile.id3Rating());
+            if (id3rating != 0)
+            {
+                ioFile.out() << "  Needs to clear rating" << std::endl;
+                newRating = 0;
+            }
+        }
+        recordID3State(ioFile, newRating);
+    }
+}
+
+//------------------
+// Files to Amarok
+
+void SyncProcessor::filesToAmarok(SyncFile &ioFile)
+{
+    QString currentFileName(ioFile.fileName());
+
+    if (FileStore::isMP3(ioFile.info().fileName()))
+    {
+        // Nothing to do if the file did not change since it was copied to Amarok
+        FileState &state = ioFile.state;
+        bool isKnown = ioFile.isStateKnown;
+        if (isKnown && StateCache::isSynced(state, StateCache::Amarok, m_forceCopy))
+        {
+            return;
+        }
+
+        int id3rating = 0;
+        if (isKnown)
+        {
+            id3rating = state.rating.toInt();
+        }
+        else
+        {
+            id3rating = ioFile.id3Rating();
+        }
+        // Files which are not in the collection yet, or whose rating could not be read or written,
+        // are not recorded as synced
+        bool urlPresent = true;
+        bool isWritten = true;
+        if (id3rating > 0)
+        {
+            int amarokRating = 0;
+            isWritten = m_amarokDb->getRating(currentFileName, urlPresent, amarokRating);
+            if (!isWritten)
+            {
+                ioFile.out() << "  Cannot read Amarok rating" << std::endl;
+            }
+            else if (!urlPresent)
+            {
+                ioFile.out() << "  File has rating " << id3rating << " but is not in Amarok collection. Do nothing" << std::endl;
+            }
+            else
+            {
+                if (id3rating != amarokRating)
+                {
+                    ioFile.out() << "  Needs to copy rating: " << id3rating << std::endl;
+                    isWritten = writeAmarok(ioFile, amarokRating, id3rating);
+                }
+            }
+        }
+        else if (m_forceCopy)
+        {
+            int amarokRating = 0;
+            isWritten = m_amarokDb->getRating(currentFileName, urlPresent, amarokRating);
+            if (!isWritten)
+            {
+                ioFile.out() << "  Cannot read Amarok rating" << std::endl;
+            }
+            else if (amarokRating != 0)
+            {
+                ioFile.out() << "  Needs to clear rating" << std::endl;
+                isWritten = writeAmarok(ioFile, amarokRating, id3rating);
+            }
+        }
+
+        state.rating = QString::number(id3rating);
+        if (urlPresent && isWritten)
+        {
+            state.syncedStores |= StateCache::syncedFlag(StateCache::Amarok, m_forceCopy);
+        }
+        recordState(ioFile);
+    }
+}
+
+// Files which are not handled are left out. The file metadata is read here when the file changed
+// since the previous run and is to be read by the actions, so that it is not read by the synchronization stage.
+SyncFile* SyncProcessor::readFile(const QFileInfo &iFile)
+{
+    if (!isHandled(iFile))
+    {
+        // The state of images is kept for the Nepomuk actions of other runs
+        if (m_stateCache && FileStore::isImage(iFile.fileName()))
+        {
+            m_stateCache->markSeen(iFile.filePath());
+        }
+        return 0;
+    }
+    SyncFile* file = new SyncFile(iFile, m_useSidecar, m_isVerbose, m_isBuffered);
+    if (m_stateCache)
+    {
+        file->isStateKnown = m_stateCache->lookup(file->fileName(), stateSidecarFileName(iFile), file->state);
+    }
+    if (m_nbSyncJobs > 0 && !file->isStateKnown)
+    {
+        foreach (Action action, m_actions)
+        {
+            if (action == NepomukToFiles || action == FilesToNepomuk || action == AmarokToFiles || action == FilesToAmarok)
+            {
+                if (FileStore::isImage(iFile.fileName()))
+                {
+                    file->image().keywords();
+                    file->image().rating();
+                }
+                else if (FileStore::isMP3(iFile.fileName()))
+                {
+                    file->id3Rating();
+                }
+                break;
+            }
+        }
+    }
+    if (m_nbSyncJobs > 0)
+    {
+        // Nepomuk is read in the background while the file waits for the synchronization stage
+        foreach (Action action, m_actions)
+        {
+            bool isSyncedToNepomuk = file->isStateKnown && StateCache::isSynced(file->state, StateCache::Nepomuk, m_forceCopy);
+            if (action == NepomukToFiles || action == DisplayNepomuk || action == ClearNepomuk
+                || (action == FilesToNepomuk && !isSyncedToNepomuk))
+            {
+                file->nepomukRequest = m_nepomuk->requestFile(iFile.absoluteFilePath());
+                break;
+            }
+        }
+    }
+    return file;
+}
+
+void SyncProcessor::syncFile(SyncFile &ioFile)
+{
+    foreach (Action action, m_actions)
+    {
+        switch (action)
+        {
+        case NepomukToFiles: nepomukToFiles(ioFile); break;
+        case FilesToNepomuk: filesToNepomuk(ioFile); break;
+        case DisplayNepomuk: displayNepomuk(ioFile); break;
+        case ClearNepomuk:   clearNepomuk(ioFile); break;
+        case AmarokToFiles:  amarokToFiles(ioFile); break;
+        case FilesToAmarok:  filesToAmarok(ioFile); break;
+        }
+    }
+}
+
+// Writes the changes of all actions at once, then records the state of the file.
+// With --plan, the changes are written to the plan instead.
+void SyncProcessor::writeFile(SyncFile &ioFile)
+{
+    if (m_plan)
+    {
+        if (!ioFile.plannedChanges.isEmpty() && !m_plan->write(ioFile.plannedChanges))
+        {
+            ioFile.out() << "  Cannot write plan" << std::endl;
+        }
+        return;
+    }
+    if (ioFile.hasImageChanges())
+    {
+        ImageMetadata &image = ioFile.image();
+        m_nbRewritesSaved.fetchAndAddRelaxed(image.changeCount() - 1);
+        m_nbFilesWritten.ref();
+        if (!image.commit())
+        {
+            ioFile.out() << "  Cannot save file" << std::endl;
+            return;
+        }
+    }
+    else if (ioFile.newID3Rating >= 0)
+    {
+        if (!ioFile.writeID3Rating())
+        {
+            return;
+        }
+    }
+    else
+    {
+        return;
+    }
+    if (m_stateCache)
+    {
+        m_stateCache->update(ioFile.fileName(), stateSidecarFileName(ioFile.info()), ioFile.state, true);
+    }
+}
+
+void SyncProcessor::runSyncStage()
+{
+    SyncFile* file;
+    while (m_syncQueue.pop(file))
+    {
+        syncFile(*file);
+        m_writeQueue.push(file);
+    }
+}
+
+// Files are released here, which prints their output
+void SyncProcessor::runWriteStage()
+{
+    SyncFile* file;
+    while (m_writeQueue.pop(file))
+    {
+        writeFile(*file);
+        delete file;
+        m_nbFilesDone.ref();
+    }
+}
+
+// Starts the pipeline threads, if any, for a pass over the files
+void SyncProcessor::beginBatch()
+{
+    if (m_nbSyncJobs == 0)
+    {
+        return;
+    }
+    m_syncQueue.reset();
+    m_writeQueue.reset();
+    m_nbFilesDone = 0;
+    m_batchTime.start();
+    for (int i=0; i<m_nbSyncJobs; ++i)
+    {
+        m_syncThreads.append(new StageThread<SyncProcessor>(*this, &SyncProcessor::runSyncStage));
+        m_syncThreads.last()->start();
+    }
+    m_writeThread = new StageThread<SyncProcessor>(*this, &SyncProcessor::runWriteStage);
+    m_writeThread->start();
+}
+
+void SyncProcessor::displayStage(const char* iName, int iNbFiles, const BoundedQueue<SyncFile*>* iQueue) const
+{
+    int elapsed = qMax(m_batchTime.elapsed(), 1);
+    std::cout << "  " << iName << ": " << iNbFiles << " files (" << (iNbFiles * 1000 / elapsed) << " files/s)";
+    if (iQueue)
+    {
+        std::cout << ", queue depth average " << QString::number(iQueue->averageDepth(), 'f', 1).toStdString()
+                  << ", max " << iQueue->maxDepth();
+    }
+    std::cout << std::endl;
+}
+
+// Writes what was delayed during a pass over the files: Amarok ratings, then state of the files
+void SyncProcessor::endBatch()
+{
+    if (m_nbSyncJobs > 0)
+    {
+        // Each stage ends once the previous one is done and its queue is empty
+        m_syncQueue.close();
+        foreach (QThread* thread, m_syncThreads)
+        {
+            thread->wait();
+            delete thread;
+        }
+        m_syncThreads.clear();
+        m_writeQueue.close();
+        m_writeThread->wait();
+        delete m_writeThread;
+        if (m_isVerbose)
+        {
+            std::cout << "Pipeline:" << std::endl;
+            displayStage("read", m_syncQueue.nbPushed(), 0);
+            displayStage("synchronize", m_writeQueue.nbPushed(), &m_syncQueue);
+            displayStage("write", m_nbFilesDone, &m_writeQueue);
+        }
+    }
+
+    // Files are recorded as copied to Nepomuk or Amarok only if the changes were actually written
+    bool isWritten = m_nepomuk->flushChanges();
+    if (m_actions.contains(FilesToAmarok))
+    {
+        isWritten = m_amarokDb->flushRatings() && isWritten;
+    }
+    // The snapshots do not follow changes made in the stores after they were loaded
+    m_nepomuk->clearSnapshot();
+    if (m_amarokDb)
+    {
+        m_amarokDb->clearSnapshot();
+    }
+    if (m_stateCache)
+    {
+        if (isWritten && !m_plan)
+        {
+            m_stateCache->save();
+        }
+        else
+        {
+            m_stateCache->discardChanges();
+        }
+    }
+}
@@ -0,0 +1,123 @@
+/*
+ * This file is part of Neposync program.
+ * Copyright (C) 2010 Eric Pignet <eric at erixpage dot com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef SYNCPROCESSOR_H
+#define SYNCPROCESSOR_H
+
+#include <QtCore/QAtomicInt>
+#include <QtCore/QFileInfo>
+#include <QtCore/QList>
+#include <QtCore/QString>
+#include <QtCore/QTime>
+#include <QtCore/QVariant>
+
+#include "ChangePlan.h"
+#include "FileWalker.h"
+#include "NepomukCollection.h"
+#include "Pipeline.h"
+#include "StateCache.h"
+#include "SyncFile.h"
+
+class AmarokCollection;
+
+// Synchronization of one file for all actions, in the order they were given. Called concurrently with -j.
+//
+// A file is read (recorded state, then metadata), synchronized with the stores by the actions, then
+// written. With setPipeline(), these are stages run by different threads with queues between them,
+// so that reading and writing files overlap with the store accesses of other files: processFile()
+// reads the file and queues it for the synchronization threads, which queue it for the writer thread.
+class SyncProcessor : public FileProcessor
+{
+public:
+    enum Action { NepomukToFiles, FilesToNepomuk, DisplayNepomuk, ClearNepomuk, AmarokToFiles, FilesToAmarok };
+
+    SyncProcessor(const QList<Action> &iActions, bool iForceCopy, bool iUseSidecar, bool isVerbose, bool isBuffered,
+                  NepomukCollection* iNepomuk, AmarokCollection* iAmarokDb = 0, StateCache* iStateCache = 0);
+
+    // Synchronizes files in iNbSyncJobs threads, and writes them in another one. Output must be buffered.
+    void setPipeline(int iNbSyncJobs) { m_nbSyncJobs = iNbSyncJobs; }
+    // Changes are written to iPlan instead of being made (--plan). Files and stores are only read.
+    void setPlan(PlanWriter* iPlan) { m_plan = iPlan; }
+
+    void processFile(const QFileInfo &iFile);
+
+    void beginBatch();
+    // The batch synchronizes all the files under iDirectory: the state of other files is dropped when saved
+    void beginFullPass(const QString &iDirectory);
+    void endBatch();
+
+    int nbFilesWritten() const { return m_nbFilesWritten; }
+    int nbRewritesSaved() const { return m_nbRewritesSaved; }
+
+protected:
+    QList<Action> m_actions;
+    bool m_forceCopy;
+    bool m_useSidecar;
+    bool m_isVerbose;
+    bool m_isBuffered;
+    NepomukCollection* m_nepomuk;
+    AmarokCollection* m_amarokDb;
+    StateCache* m_stateCache;
+    PlanWriter* m_plan;
+    QAtomicInt m_nbFilesWritten;
+    QAtomicInt m_nbRewritesSaved;
+    // Pipeline
+    int m_nbSyncJobs;
+    BoundedQueue<SyncFile*> m_syncQueue;
+    BoundedQueue<SyncFile*> m_writeQueue;
+    QList<QThread*> m_syncThreads;
+    QThread* m_writeThread;
+    QTime m_batchTime;
+    QAtomicInt m_nbFilesDone;
+
+    friend class StageThread<SyncProcessor>;
+    SyncFile* readFile(const QFileInfo &iFile);
+    void syncFile(SyncFile &ioFile);
+    void writeFile(SyncFile &ioFile);
+    void runSyncStage();
+    void runWriteStage();
+    void displayStage(const char* iName, int iNbFiles, const BoundedQueue<SyncFile*>* iQueue) const;
+
+    void nepomukToFiles(SyncFile &ioFile);
+    void filesToNepomuk(SyncFile &ioFile);
+    void displayNepomuk(SyncFile &ioFile);
+    void clearNepomuk(SyncFile &ioFile);
+    void amarokToFiles(SyncFile &ioFile);
+    void filesToAmarok(SyncFile &ioFile);
+
+    // Images are handled by Nepomuk actions only, MP3 files by all actions
+    bool isHandled(const QFileInfo &iFile) const;
+    // Records ioFile.state, which then is the known state of the file for the next actions.
+    // A file with changes is recorded once written, see writeFile().
+    void recordState(SyncFile &ioFile);
+    // Sets the rating to write, iNewRating (if not -1), and records the resulting rating
+    void recordID3State(SyncFile &ioFile, int iNewRating);
+    // Tags and rating of the file in Nepomuk, from the snapshot unless the file was changed since
+    void readNepomuk(SyncFile &iFile, NepomukFile &oNepomukFile);
+    // Queues the changes of the file in Nepomuk, written by batches of files
+    void writeNepomuk(SyncFile &ioFile, const NepomukFile &iNepomukFile, const NepomukChanges &iChanges);
+    void planNepomuk(SyncFile &ioFile, const NepomukFile &iNepomukFile, const NepomukChanges &iChanges);
+    // Queues the rating of the file in Amarok, written by batches of files. Returns false if it cannot be written.
+    bool writeAmarok(SyncFile &ioFile, int iOldRating, int iNewRating);
+    // With --plan, records a change of the file. A field changed by several actions keeps its first value.
+    void planChange(SyncFile &ioFile, PlannedChange::Field iField, const QVariant &iOldValue, const QVariant &iNewValue);
+    QString stateSidecarFileName(const QFileInfo &iFile) const;
+};
+
+#endif // SYNCPROCESSOR_H
@@ -19,20 +19,28 @@
 
 
 #include <nepomuk/global.h>
-#include <nepomuk/resource.h>
 #include <nepomuk/resourcemanager.h>
-#include <nepomuk/tag.h>
-#include <nepomuk/variant.h>
-#include <Soprano/Vocabulary/NAO>
 
+#include <fstream>
 #include <iostream>
 
 #include <libkexiv2/kexiv2.h>
 
-#include <QtCore/QDirIterator>
+#include <QtCore/QDir>
+#include <QtCore/QFile>
+#include <QtCore/QSet>
 
 #include "AmarokCollection.h"
-#include "ID3Utilities.h"
+#include "ApplyProcessor.h"
+#include "ChangePlan.h"
+#include "DelimitedWriter.h"
+#include "DirectoryWatcher.h"
+#include "FileList.h"
+#include "FileStore.h"
+#include "FileWalker.h"
+#include "NepomukCollection.h"
+#include "StateCache.h"
+#include "SyncProcessor.h"
 
 void showUsage()
 {
@@ -49,16 +57,38 @@ void showUsage()
     std::cout << "  -fa, --files-to-amarok     Read ratings from files metadata and store them in Amarok collection" << std::endl;
     std::cout << "  -da, --display-amarok      Display all Amarok ratings" << std::endl;
     std::cout << "  -qa, --query-amarok QUERY  Execute Mysql query QUERY in Amarok collection" << std::endl;
+    std::cout << "Actions (any stores):" << std::endl;
+    std::cout << "       --copy SOURCE DEST    Copy tags/ratings from store SOURCE to store DEST (files, nepomuk or amarok)," << std::endl;
+    std::cout << "                             comparing the files of both stores in a single sorted pass" << std::endl;
+    std::cout << "                             (the Amarok tracks under the directory are held in memory)" << std::endl;
+    std::cout << "Actions (plans):" << std::endl;
+    std::cout << "       --apply FILE          Make the changes of a plan written by --plan, except those of fields changed since" << std::endl;
     std::cout << "Options:" << std::endl;
     std::cout << "  -r   --recursive           Recurse into sub-directories" << std::endl;
     std::cout << "  -f   --force               Copy tags/ratings even if empty on source side" << std::endl;
+    std::cout << "       --sidecar             Read/write image tags/ratings in XMP sidecar files (image.jpg.xmp, as Digikam)" << std::endl;
+    std::cout << "       --csv                 Print --query-amarok results as CSV, with values quoted as needed (RFC 4180)" << std::endl;
+    std::cout << "       --tsv                 Print --query-amarok results as tab-separated values, with escaped tabs and newlines" << std::endl;
+    std::cout << "       --batch-size N        Write Nepomuk changes and Amarok ratings by batches of N files (default 500)" << std::endl;
+    std::cout << "  -j   --jobs N              Process N files at once (default 1)" << std::endl;
+    std::cout << "       --pipeline            Read, synchronize and write files in separate threads (N each for reading and" << std::endl;
+    std::cout << "                             synchronizing with -j N), so that file and store accesses overlap" << std::endl;
+    std::cout << "       --nepomuk-window N    With --pipeline, read Nepomuk with up to N calls in flight (default 8)" << std::endl;
+    std::cout << "       --state FILE          Remember files state in FILE, to skip files unchanged since the previous run" << std::endl;
+    std::cout << "       --watch               After synchronizing, keep synchronizing files as they are written (until interrupted)" << std::endl;
+    std::cout << "       --files-from FILE     Synchronize the files listed in FILE (- for standard input) instead of DIRECTORY files," << std::endl;
+    std::cout << "                             one path per line or NUL-separated, relative paths being relative to DIRECTORY" << std::endl;
+    std::cout << "       --plan FILE           Write the changes the actions would make to FILE (one JSON object per line:" << std::endl;
+    std::cout << "                             file, field, old and new value) instead of making them" << std::endl;
     std::cout << "  -V   --verbose             Display all nepomuk output (depending on KDebug settings)" << std::endl;
     std::cout << "  -h   --help                Display this usage information" << std::endl;
     std::cout << "       --version             Display version and copyright information" << std::endl;
     std::cout << "DIRECTORY is optional, if absent the current directory is synchronized" << std::endl;
+    std::cout << "Several actions can be combined (e.g. -fn -fa): each file is then read once for all of them" << std::endl;
     std::cout << std::endl;
     std::cout << "Remarks: neposync uses IPTC 'keyword' metadata to read/store tags in image files (as Digikam)" << std::endl;
     std::cout << "         neposync uses XMP 'Rating' metadata to read/store ratings in image files (as Digikam)" << std::endl;
+    std::cout << "         with --sidecar, neposync uses XMP 'subject' metadata to read/store tags in XMP sidecar files" << std::endl;
     std::cout << "         neposync uses ID3v2 'Popularimeter/POPM' metadata to read/store ratings in MP3 files" << std::endl;
 }
 
@@ -69,22 +99,98 @@ void showVersion()
     std::cout << "Licence GPLv2+" << std::endl;
 }
 
-void displayFileName(QString iFileName, bool isNewFile = false, bool isVerbose = false)
+// Quiet period after the last change before files are synchronized, so that a burst of writes is handled once
+static const int watchDebounceMs = 1000;
+
+// Synchronizes all files (or the files of iFileList if given), then with iWatch the files written later,
+// until interrupted. Libraries and Amarok connection stay initialized between changes.
+static bool synchronize(FileWalker &iWalker, SyncProcessor &iProcessor, const QString &iDirectory, bool iRecursive, FileList *iFileList, bool iWatch, bool iUseSidecar, bool isVerbose)
 {
-    static bool fileDisplayed;
-    if (isNewFile)
+    // Changes made during the first pass are queued until it ends
+    DirectoryWatcher watcher(iDirectory, iRecursive, isVerbose);
+    if (iWatch && !watcher.start())
+    {
+        return false;
+    }
+
+    iProcessor.beginBatch();
+    if (!iFileList && iRecursive)
+    {
+        iProcessor.beginFullPass(iDirectory);
+    }
+    if (iFileList)
+    {
+        iWalker.run(*iFileList, iProcessor);
+        if (isVerbose && iFileList->nbSkipped() > 0)
+        {
+            std::cout << "Listed paths skipped: " << iFileList->nbSkipped() << std::endl;
+        }
+    }
+    else
     {
-        fileDisplayed = false;
+        iWalker.run(iProcessor);
     }
-    if (    (isNewFile && isVerbose)
-         || (!isNewFile && !fileDisplayed)
-       )
+    iProcessor.endBatch();
+    if (!iWatch)
     {
-        std::cout << "File: " << QString(iFileName.toLocal8Bit()).toStdString() << std::endl;
-        fileDisplayed = true;
+        return true;
     }
+
+    QStringList changedFiles;
+    bool isRescanNeeded = false;
+    while (watcher.waitForChanges(changedFiles, isRescanNeeded, watchDebounceMs))
+    {
+        iProcessor.beginBatch();
+        if (isRescanNeeded)
+        {
+            if (isVerbose)
+            {
+                std::cout << "Changes were lost, synchronizing all files" << std::endl;
+            }
+            if (iRecursive)
+            {
+                iProcessor.beginFullPass(iDirectory);
+            }
+            iWalker.run(iProcessor);
+        }
+        else
+        {
+            QStringList files;
+            QSet<QString> knownFiles;
+            foreach (QString file, changedFiles)
+            {
+                // A sidecar change is a change of its image
+                if (iUseSidecar && file.endsWith(".xmp", Qt::CaseInsensitive))
+                {
+                    file.chop(4);
+                }
+                if (!knownFiles.contains(file) && QFileInfo(file).isFile())
+                {
+                    knownFiles.insert(file);
+                    files.append(file);
+                }
+            }
+            if (isVerbose)
+            {
+                std::cout << "Synchronizing " << files.size() << " changed files" << std::endl;
+            }
+            iWalker.run(files, iProcessor);
+        }
+        iProcessor.endBatch();
+    }
+    return true;
 }
 
+class RatingPrinter : public AmarokRatingHandler
+{
+public:
+    bool rating(const QString &iUrl, int iRating)
+    {
+        std::cout << QString(iUrl.toLocal8Bit()).toStdString() << ": " << iRating << '\n';
+        return true;
+    }
+};
+
 
 int main(int argc, char *argv[])
 {
@@ -97,10 +203,28 @@ int main(int argc, char *argv[])
     bool isDisplayAmarok = false;
     bool isQueryAmarok = false;
     QString amarokQuery;
+    bool csvOutput = false;
+    bool tsvOutput = false;
+    bool useSidecar = false;
     bool forceCopy = false;
     bool recurseDirectories = false;
     bool isVerbose = false;
+    int batchSize = 500;
+    int nbJobs = 1;
+    QString stateFileName;
+    bool watch = false;
+    bool usePipeline = false;
+    int nepomukWindow = 8;
+    QString filesFromName;
+    QString planFileName;
+    bool isApply = false;
+    QString applyFileName;
+    bool isCopy = false;
+    QString copySource;
+    QString copyDestination;
     int nbActions = 0;
+    // Actions run on each file, in the order they are given
+    QList<SyncProcessor::Action> fileActions;
     QString workingDirectory;
 
     //------------------
@@ -110,31 +234,55 @@ int main(int argc, char *argv[])
     {
         if (!strcmp(argv[i], "-nf") || !strcmp(argv[i],"--nepomuk-to-files"))
         {
+            if (!isNepomukToFiles)
+            {
+                fileActions.append(SyncProcessor::NepomukToFiles);
+            }
             isNepomukToFiles = true;
             nbActions ++;
         }
         else if (!strcmp(argv[i], "-fn") || !strcmp(argv[i],"--files-to-nepomuk"))
         {
+            if (!isFilesToNepomuk)
+            {
+                fileActions.append(SyncProcessor::FilesToNepomuk);
+            }
             isFilesToNepomuk = true;
             nbActions ++;
         }
         else if (!strcmp(argv[i], "-dn") || !strcmp(argv[i],"--display-nepomuk"))
         {
+            if (!isDisplayNepomuk)
+            {
+                fileActions.append(SyncProcessor::DisplayNepomuk);
+            }
             isDisplayNepomuk = true;
             nbActions ++;
         }
         else if (!strcmp(argv[i], "-cn") || !strcmp(argv[i],"--clear-nepomuk"))
         {
+            if (!isClearNepomuk)
+            {
+                fileActions.append(SyncProcessor::ClearNepomuk);
+            }
             isClearNepomuk = true;
             nbActions ++;
         }
         else if (!strcmp(argv[i], "-af") || !strcmp(argv[i],"--amarok-to-files"))
         {
+            if (!isAmarokToFiles)
+            {
+                fileActions.append(SyncProcessor::AmarokToFiles);
+            }
             isAmarokToFiles = true;
             nbActions ++;
         }
         else if (!strcmp(argv[i], "-fa") || !strcmp(argv[i],"--files-to-amarok"))
         {
+            if (!isFilesToAmarok)
+            {
+                fileActions.append(SyncProcessor::FilesToAmarok);
+            }
             isFilesToAmarok = true;
             nbActions ++;
         }
@@ -158,6 +306,45 @@ int main(int argc, char *argv[])
                 amarokQuery = argv[i];
             }
         }
+        else if (!strcmp(argv[i], "--copy"))
+        {
+            isCopy = true;
+            nbActions ++;
+            QStringList stores;
+            stores << "files" << "nepomuk" << "amarok";
+            if ((i+2 >= argc) || !stores.contains(argv[i+1]) || !stores.contains(argv[i+2]) || !strcmp(argv[i+1], argv[i+2]))
+            {
+                std::cout << "Two different stores (files, nepomuk or amarok) must follow --copy action." << std::endl;
+                return 1;
+            }
+            copySource = argv[i+1];
+            copyDestination = argv[i+2];
+            i += 2;
+        }
+        else if (!strcmp(argv[i], "--apply"))
+        {
+            isApply = true;
+            nbActions ++;
+            i++;
+            if (i == argc)
+            {
+                std::cout << "A plan file name must follow --apply action." << std::endl;
+                return 1;
+            }
+            applyFileName = QString::fromLocal8Bit(argv[i]);
+        }
+        else if (!strcmp(argv[i], "--sidecar"))
+        {
+            useSidecar = true;
+        }
+        else if (!strcmp(argv[i], "--csv"))
+        {
+            csvOutput = true;
+        }
+        else if (!strcmp(argv[i], "--tsv"))
+        {
+            tsvOutput = true;
+        }
         else if (!strcmp(argv[i], "-r") || !strcmp(argv[i], "--recursive"))
         {
             recurseDirectories = true;
@@ -166,6 +353,71 @@ int main(int argc, char *argv[])
         {
             forceCopy = true;
         }
+        else if (!strcmp(argv[i], "--batch-size"))
+        {
+            i++;
+            if ((i == argc) || (batchSize = QString(argv[i]).toInt()) <= 0)
+            {
+                std::cout << "A positive number must follow --batch-size option." << std::endl;
+                return 1;
+            }
+        }
+        else if (!strcmp(argv[i], "-j") || !strcmp(argv[i], "--jobs"))
+        {
+            i++;
+            if ((i == argc) || (nbJobs = QString(argv[i]).toInt()) <= 0)
+            {
+                std::cout << "A positive number must follow --jobs option." << std::endl;
+                return 1;
+            }
+        }
+        else if (!strcmp(argv[i], "--pipeline"))
+        {
+            usePipeline = true;
+        }
+        else if (!strcmp(argv[i], "--nepomuk-window"))
+        {
+            i++;
+            if ((i == argc) || (nepomukWindow = QString(argv[i]).toInt()) <= 0)
+            {
+                std::cout << "A positive number must follow --nepomuk-window option." << std::endl;
+                return 1;
+            }
+        }
+        else if (!strcmp(argv[i], "--watch"))
+        {
+            watch = true;
+        }
+        else if (!strcmp(argv[i], "--files-from"))
+        {
+            i++;
+            if (i == argc)
+            {
+                std::cout << "A file name (or -) must follow --files-from option." << std::endl;
+                return 1;
+            }
+            filesFromName = QString::fromLocal8Bit(argv[i]);
+        }
+        else if (!strcmp(argv[i], "--plan"))
+        {
+            i++;
+            if (i == argc)
+            {
+                std::cout << "A file name must follow --plan option." << std::endl;
+                return 1;
+            }
+            planFileName = QString::fromLocal8Bit(argv[i]);
+        }
+        else if (!strcmp(argv[i], "--state"))
+        {
+            i++;
+            if (i == argc)
+            {
+                std::cout << "A file name must follow --state option." << std::endl;
+                return 1;
+            }
+            stateFileName = QString::fromLocal8Bit(argv[i]);
+        }
         else if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help"))
         {
             showUsage();
@@ -191,9 +443,35 @@ int main(int argc, char *argv[])
         showUsage();
         return 0;
     }
-    else if (nbActions > 1)
+    else if (isNepomukToFiles + isFilesToNepomuk + isClearNepomuk > 1)
+    {
+        std::cout << "Nepomuk can be synchronized in one direction only." << std::endl;
+        return 1;
+    }
+    else if (isAmarokToFiles && isFilesToAmarok)
     {
-        std::cout << "Only one action must be specified." << std::endl;
+        std::cout << "Amarok can be synchronized in one direction only." << std::endl;
+        return 1;
+    }
+    else if (csvOutput && tsvOutput)
+    {
+        std::cout << "--csv and --tsv options cannot be used together." << std::endl;
+        return 1;
+    }
+    else if (watch && !filesFromName.isEmpty())
+    {
+        std::cout << "--watch and --files-from options cannot be used together." << std::endl;
+        return 1;
+    }
+    else if (!planFileName.isEmpty() && (watch || isApply || isDisplayAmarok || isQueryAmarok
+                                         || isNepomukToFiles + isFilesToNepomuk + isClearNepomuk + isAmarokToFiles + isFilesToAmarok == 0))
+    {
+        std::cout << "--plan option needs an action changing files or stores (-nf, -fn, -cn, -af or -fa), and cannot be used with other actions or with --watch." << std::endl;
+        return 1;
+    }
+    else if ((isApply || isCopy) && (nbActions > 1 || watch || !filesFromName.isEmpty() || !planFileName.isEmpty()))
+    {
+        std::cout << "--apply and --copy actions cannot be combined with other actions, --plan, --watch or --files-from." << std::endl;
         return 1;
     }
 
@@ -237,440 +515,198 @@ int main(int argc, char *argv[])
     if (isVerbose)
         std::cout << "Path used: " << std::string(workingDirectory.toLocal8Bit()) << std::endl;
 
-    //------------------
-    // Nepomuk to files
+    // Files are processed in parallel with -j or --pipeline, and their output is then printed file by file
+    FileWalker walker(workingDirectory, recurseDirectories, nbJobs);
+    bool isBuffered = (nbJobs > 1 || usePipeline);
 
-    if (isNepomukToFiles)
+    // With --state, files which did not change since the previous run are not read again
+    StateCache* stateCache = 0;
+    if (!stateFileName.isEmpty())
+    {
+        stateCache = new StateCache(stateFileName, isVerbose);
+        stateCache->load();
+    }
+    int result = 0;
+
+    // With --apply, the plan is read first: it tells whether Amarok is needed.
+    // Changes are grouped by file, in the order of the plan.
+    QHash<QString, QList<PlannedChange> > plannedChanges;
+    QStringList plannedFiles;
+    bool isApplyAmarok = false;
+    if (isApply)
     {
-        QDirIterator it(workingDirectory, QDir::Files | QDir::NoDotAndDotDot, (recurseDirectories?QDirIterator::Subdirectories:QDirIterator::NoIteratorFlags));
-        while (it.hasNext())
+        std::ifstream planInput(QFile::encodeName(applyFileName).constData());
+        if (!planInput)
         {
-            QString currentFileName(it.next());
-
-            if (   !it.fileInfo().suffix().compare("jpg", Qt::CaseInsensitive)
-                || !it.fileInfo().suffix().compare("jpeg", Qt::CaseInsensitive))
-            {
-                displayFileName(currentFileName, true, isVerbose);
-
-                Nepomuk::Resource aFile(it.filePath());
-
-                // Copy of tags
-                QList<Nepomuk::Variant> vl = aFile.property( Soprano::Vocabulary::NAO::hasTag() ).toVariantList();
-                if (!vl.isEmpty() || forceCopy)
-                {
-                    KExiv2Iface::KExiv2 myExifData(currentFileName);
-                    QStringList oldKeywords = myExifData.getIptcKeywords();
-                    QStringList newKeywords;
-                    foreach (Nepomuk::Variant vv, vl)
-                    {
-                        Nepomuk::Tag tag(vv.toString());
-                        newKeywords.append(tag.label());
-                    }
-                    QStringList oldKeywordsSorted(oldKeywords);
-                    QStringList newKeywordsSorted(newKeywords);
-                    oldKeywordsSorted.sort();
-                    newKeywordsSorted.sort();
-                    if (oldKeywordsSorted != newKeywordsSorted)
-                    {
-                        displayFileName(currentFileName);
-                        std::cout << "  Needs to replace IPTC keywords to: ";
-                        foreach (QString keyword, newKeywords) std::cout << keyword.toStdString() << " ";
-                        std::cout << std::endl;
-                        myExifData.setIptcKeywords(oldKeywords, newKeywordsSorted);
-                        myExifData.applyChanges();
-                    }
-                }
-
-                // Copy of rating
-                if (aFile.hasProperty(aFile.ratingUri()))
-                {
-                    KExiv2Iface::KExiv2 myXMPData(currentFileName);
-                    QString rating = myXMPData.getXmpTagString("Xmp.xmp.Rating");
-                    if (rating.isNull() || rating.toUInt() != aFile.rating())
-                    {
-                        displayFileName(currentFileName);
-                        std::cout << "  Needs to copy rating: " << QString::number(aFile.rating()).toStdString() << std::endl;
-                        myXMPData.setXmpTagString("Xmp.xmp.Rating",QString::number(aFile.rating()), false);
-                        myXMPData.applyChanges();
-                    }
-                }
-                else if (forceCopy)
-                {
-                    KExiv2Iface::KExiv2 myXMPData(currentFileName);
-                    QString rating = myXMPData.getXmpTagString("Xmp.xmp.Rating");
-                    if (!rating.isNull())
-                    {
-                        displayFileName(currentFileName);
-                        std::cout << "  Needs to clear rating" << std::endl;
-                        myXMPData.setXmpTagString("Xmp.xmp.Rating",NULL, false);
-                        myXMPData.applyChanges();
-                    }
-                }
-            }
-            else if (!it.fileInfo().suffix().compare("mp3", Qt::CaseInsensitive))
+            std::cout << "Error: cannot open " << std::string(applyFileName.toLocal8Bit()) << std::endl;
+            delete stateCache;
+            return 1;
+        }
+        PlanReader reader(planInput);
+        PlannedChange change;
+        while (reader.next(change))
+        {
+            QString file = QFileInfo(change.fileName).absoluteFilePath();
+            if (!plannedChanges.contains(file))
             {
-                displayFileName(currentFileName, true, isVerbose);
-
-                Nepomuk::Resource aFile(it.filePath());
-
-                if (aFile.hasProperty(aFile.ratingUri()))
-                {
-                    int id3rating = 0;
-                    ID3Utilities::getID3Rating(currentFileName, id3rating, isVerbose);
-                    if ((unsigned int)id3rating != aFile.rating())
-                    {
-                        displayFileName(currentFileName);
-                        std::cout << "  Needs to copy rating: " << aFile.rating() << "/10" << std::endl;
-                        ID3Utilities::setID3Rating(currentFileName, aFile.rating(), isVerbose);
-                    }
-                }
-                else if (forceCopy)
-                {
-                    int id3rating = 0;
-                    ID3Utilities::getID3Rating(currentFileName, id3rating, isVerbose);
-                    if (id3rating > 0)
-                    {
-                        displayFileName(currentFileName);
-                        std::cout << "  Needs to clear rating" << std::endl;
-                        ID3Utilities::setID3Rating(currentFileName, 0, isVerbose);
-                    }
-                }
+                plannedFiles.append(file);
             }
+            plannedChanges[file].append(change);
+            isApplyAmarok = isApplyAmarok || change.field == PlannedChange::AmarokRating;
+        }
+        if (reader.isError())
+        {
+            delete stateCache;
+            return 1;
         }
     }
 
-    //------------------
-    // Files to Nepomuk
+    NepomukCollection nepomuk(isVerbose);
+    nepomuk.setBatchSize(batchSize);
 
-    if (isFilesToNepomuk)
+    // Amarok initialization
+    AmarokCollection amarokDb(isVerbose);
+    bool useAmarok = (isAmarokToFiles || isFilesToAmarok || isDisplayAmarok || isQueryAmarok || isApplyAmarok
+                      || (isCopy && (copySource == "amarok" || copyDestination == "amarok")));
+    if (useAmarok)
     {
-        QDirIterator it(workingDirectory, QDir::Files | QDir::NoDotAndDotDot, (recurseDirectories?QDirIterator::Subdirectories:QDirIterator::NoIteratorFlags));
-        while (it.hasNext()) {
-            QString currentFileName(it.next());
-
-            if (   !it.fileInfo().suffix().compare("jpg", Qt::CaseInsensitive)
-                || !it.fileInfo().suffix().compare("jpeg", Qt::CaseInsensitive))
-            {
-                KExiv2Iface::KExiv2 myExifData(currentFileName);
-                displayFileName(currentFileName, true, isVerbose);
-
-                // Copy of tags
-                QStringList keywords = myExifData.getIptcKeywords();
-                if (!keywords.isEmpty() || forceCopy)
-                {
-                    Nepomuk::Resource aFile(it.fileInfo().absoluteFilePath());
-                    QList<Nepomuk::Tag> fileTags = aFile.tags();
-
-                    // Remove unneeded tags, if any (more performant than removing everything then recreating)
-                    QList<Nepomuk::Variant> tagsToRemove;
-                    foreach (Nepomuk::Tag fileTag, fileTags)
-                    {
-                        if (!keywords.contains(fileTag.label()))
-                        {
-                            displayFileName(currentFileName);
-                            std::cout << "  Needs to remove tag: " << fileTag.label().toStdString() << std::endl;
-                            tagsToRemove.append(fileTag.resourceUri());
-                        }
-                    }
-                    if (!tagsToRemove.isEmpty())
-                    {
-                        Nepomuk::Variant tagsToRemoveVar(tagsToRemove);
-                        aFile.removeProperty(Soprano::Vocabulary::NAO::hasTag(), tagsToRemoveVar);
-                    }
-
-                    // Add missing tags
-                    foreach (const QString& keyword, keywords)
-                    {
-                        if (!fileTags.contains(keyword))
-                        {
-                            displayFileName(currentFileName);
-                            std::cout << "  Needs to add tag: " << QString(keyword.toLocal8Bit()).toStdString() << std::endl;
-                            Nepomuk::Tag tag(keyword);
-                            tag.setLabel(keyword);
-                            aFile.addTag(tag);
-                        }
-                    }
-                }
-
-                // Copy of rating
-                QString rating = myExifData.getXmpTagString("Xmp.xmp.Rating");
-                if (!rating.isNull())
-                {
-                    Nepomuk::Resource aFile(it.fileInfo().absoluteFilePath());
-                    if (!aFile.hasProperty(aFile.ratingUri()) || rating.toUInt() != aFile.rating())
-                    {
-                        displayFileName(currentFileName);
-                        std::cout << "  Needs to replace rating: " << rating.toStdString() << std::endl;
-                        aFile.setRating(rating.toUInt());
-                    }
-                }
-                else if (forceCopy)
-                {
-                    Nepomuk::Resource aFile(it.fileInfo().absoluteFilePath());
-                    if (aFile.hasProperty(aFile.ratingUri()))
-                    {
-                        displayFileName(currentFileName);
-                        std::cout << "  Needs to clear rating" << std::endl;
-                        aFile.removeProperty(aFile.ratingUri());
-                    }
-                }
-            }
-            else if (!it.fileInfo().suffix().compare("mp3", Qt::CaseInsensitive))
-            {
-                displayFileName(currentFileName, true, isVerbose);
-
-                int id3rating = 0;
-                ID3Utilities::getID3Rating(currentFileName, id3rating, isVerbose);
-                if (id3rating > 0)
-                {
-                    Nepomuk::Resource aFile(it.fileInfo().absoluteFilePath());
-                    if (!aFile.hasProperty(aFile.ratingUri()) || ((unsigned int)id3rating != aFile.rating()))
-                    {
-                        displayFileName(currentFileName);
-                        std::cout << "  Needs to replace rating: " << id3rating << std::endl;
-                        aFile.setRating((unsigned int)id3rating);
-                    }
-                }
-                else if (forceCopy)
-                {
-                    Nepomuk::Resource aFile(it.fileInfo().absoluteFilePath());
-                    if (aFile.hasProperty(aFile.ratingUri()))
-                    {
-                        displayFileName(currentFileName);
-                        std::cout << "  Needs to clear rating" << std::endl;
-                        aFile.removeProperty(aFile.ratingUri());
-                    }
-                }
-            }
+        if (!amarokDb.connect())
+        {
+            delete stateCache;
+            return 1;
         }
+        amarokDb.setBatchSize(batchSize);
     }
 
     //------------------
-    // Display Nepomuk
+    // Actions on files: all requested actions are done in a single pass, each file being read once
 
-    if (isDisplayNepomuk)
+    if (!fileActions.isEmpty())
     {
-        if (forceCopy)
+        if (forceCopy && nbActions == 1 && isDisplayNepomuk)
         {
             std::cout << "In display-nepomuk mode, --force-copy option has no effect." << std::endl;
         }
-
-        QDirIterator it(workingDirectory, QDir::Files | QDir::NoDotAndDotDot, (recurseDirectories?QDirIterator::Subdirectories:QDirIterator::NoIteratorFlags));
-        while (it.hasNext())
+        if (forceCopy && nbActions == 1 && isClearNepomuk)
         {
-            QString currentFileName(it.next());
+            std::cout << "In clear-nepomuk mode, --force-copy option has no effect." << std::endl;
+        }
 
-            if (   !it.fileInfo().suffix().compare("jpg", Qt::CaseInsensitive)
-                || !it.fileInfo().suffix().compare("jpeg", Qt::CaseInsensitive))
+        // A list usually names a few files of a large tree: they are then queried one by one
+        FileList* fileList = 0;
+        if (!filesFromName.isEmpty())
+        {
+            fileList = new FileList(filesFromName, workingDirectory, isVerbose);
+            if (!fileList->open())
             {
-                displayFileName(currentFileName, true, isVerbose);
-
-                Nepomuk::Resource aFile(it.filePath());
-
-                // Display tags
-                QList<Nepomuk::Tag> fileTags = aFile.tags();
-                if (!fileTags.isEmpty())
-                {
-                    displayFileName(currentFileName);
-                    std::cout << "  Tags:";
-                    foreach (Nepomuk::Tag fileTag, fileTags)
-                    {
-                        std::cout << " " << QString(fileTag.label().toLocal8Bit()).toStdString();
-                    }
-                    std::cout << std::endl;
-                }
-
-                // Display rating
-                if (aFile.hasProperty(aFile.ratingUri()))
-                {
-                    displayFileName(currentFileName);
-                    std::cout << "  Rating: " << aFile.rating() << std::endl;
-                }
+                delete fileList;
+                delete stateCache;
+                return 1;
             }
-            else if (!it.fileInfo().suffix().compare("mp3", Qt::CaseInsensitive))
+        }
+        else
+        {
+            // Load all Amarok urls or Nepomuk files under working directory at once, then look them up in memory.
+            // If a snapshot cannot be loaded, each file falls back to its own queries.
+            if (isAmarokToFiles || isFilesToAmarok)
             {
-                displayFileName(currentFileName, true, isVerbose);
-
-                Nepomuk::Resource aFile(it.filePath());
-                if (aFile.hasProperty(aFile.ratingUri()))
-                {
-                    displayFileName(currentFileName);
-                    std::cout << "  Rating: " << aFile.rating() << std::endl;
-                }
+                amarokDb.loadSnapshot(workingDirectory);
+            }
+            if (isNepomukToFiles || isFilesToNepomuk || isDisplayNepomuk || isClearNepomuk)
+            {
+                nepomuk.loadSnapshot(QFileInfo(workingDirectory).absoluteFilePath());
             }
         }
-    }
-
-    //------------------
-    // Clear Nepomuk
 
-    if (isClearNepomuk)
-    {
-        if (forceCopy)
+        SyncProcessor processor(fileActions, forceCopy, useSidecar, isVerbose, isBuffered, &nepomuk, (useAmarok ? &amarokDb : 0), stateCache);
+        // With --plan, nothing is written but the plan
+        std::ofstream planOutput;
+        PlanWriter plan(planOutput);
+        if (!planFileName.isEmpty())
         {
-            std::cout << "In clear-nepomuk mode, --force-copy option has no effect." << std::endl;
+            planOutput.open(QFile::encodeName(planFileName).constData());
+            if (!planOutput)
+            {
+                std::cout << "Error: cannot create " << std::string(planFileName.toLocal8Bit()) << std::endl;
+                delete fileList;
+                delete stateCache;
+                return 1;
+            }
+            processor.setPlan(&plan);
         }
-
-        QDirIterator it(workingDirectory, QDir::Files | QDir::NoDotAndDotDot, (recurseDirectories?QDirIterator::Subdirectories:QDirIterator::NoIteratorFlags));
-        while (it.hasNext())
+        if (usePipeline)
         {
-            QString currentFileName(it.next());
-
-            if (   !it.fileInfo().suffix().compare("jpg", Qt::CaseInsensitive)
-                || !it.fileInfo().suffix().compare("jpeg", Qt::CaseInsensitive)
-                || !it.fileInfo().suffix().compare("mp3", Qt::CaseInsensitive))
+            processor.setPipeline(nbJobs);
+            if (isNepomukToFiles || isFilesToNepomuk || isDisplayNepomuk || isClearNepomuk)
             {
-                displayFileName(currentFileName, true, isVerbose);
-
-                Nepomuk::Resource aFile(it.filePath());
-
-                // Clear tags
-                QList<Nepomuk::Tag> fileTags = aFile.tags();
-                if (!fileTags.isEmpty())
-                {
-                    displayFileName(currentFileName);
-                    std::cout << "  Remove tags:";
-                    foreach (Nepomuk::Tag fileTag, fileTags)
-                    {
-                        std::cout << " " << fileTag.label().toStdString();
-                        aFile.removeProperty(Soprano::Vocabulary::NAO::hasTag(), fileTag.resourceUri());
-                    }
-                    std::cout << std::endl;
-                }
-
-                // Clear rating
-                if (aFile.hasProperty(aFile.ratingUri()))
-                {
-                    displayFileName(currentFileName);
-                    std::cout << "  Clear rating" << std::endl;
-                    aFile.removeProperty(aFile.ratingUri());
-                }
+                nepomuk.startRequests(nepomukWindow);
             }
         }
-    }
+        if (!synchronize(walker, processor, workingDirectory, recurseDirectories, fileList, watch, useSidecar, isVerbose))
+        {
+            result = 1;
+        }
+        delete fileList;
 
-    // Amarok initialization
-    if (isAmarokToFiles || isFilesToAmarok || isDisplayAmarok || isQueryAmarok)
-    {
-        AmarokCollection amarokDb(isVerbose);
-        if (!amarokDb.connect())
+        if (isNepomukToFiles && (isVerbose || processor.nbFilesWritten() > 0))
         {
-            return 1;
+            std::cout << "Image files written: " << processor.nbFilesWritten() << " (" << processor.nbRewritesSaved() << " rewrites saved by grouping changes)" << std::endl;
         }
+        if (!planFileName.isEmpty())
+        {
+            std::cout << "Changes planned: " << plan.nbChanges() << std::endl;
+        }
+    }
 
-        //------------------
-        // Amarok to Files
+    //------------------
+    // Copy between two stores: their files are listed sorted and merged, each store being read once
 
-        if (isAmarokToFiles)
+    if (isCopy)
+    {
+        FileStore files(useSidecar, isVerbose);
+        MetadataStore* stores[2];
+        QString names[2] = { copySource, copyDestination };
+        for (int i=0; i<2; i++)
         {
-            QDirIterator it(workingDirectory, QDir::Files | QDir::NoDotAndDotDot, (recurseDirectories?QDirIterator::Subdirectories:QDirIterator::NoIteratorFlags));
-            while (it.hasNext())
-            {
-                QString currentFileName(it.next());
-
-                if (!it.fileInfo().suffix().compare("mp3", Qt::CaseInsensitive))
-                {
-                    displayFileName(currentFileName, true, isVerbose);
-
-                    bool urlPresent = false;
-                    int amarokRating = 0;
-                    amarokDb.getRating(currentFileName, urlPresent, amarokRating);
-                    if (amarokRating > 0)
-                    {
-                        int id3rating = 0;
-                        ID3Utilities::getID3Rating(currentFileName, id3rating, isVerbose);
-                        if (id3rating != amarokRating)
-                        {
-                            displayFileName(currentFileName);
-                            std::cout << "  Needs to copy rating: " << amarokRating << "/10" << std::endl;
-                            ID3Utilities::setID3Rating(currentFileName, amarokRating, isVerbose);
-                        }
-                    }
-                    else if (forceCopy)
-                    {
-                        int id3rating = 0;
-                        ID3Utilities::getID3Rating(currentFileName, id3rating, isVerbose);
-                        if (id3rating != 0)
-                        {
-                            displayFileName(currentFileName);
-                            std::cout << "  Needs to clear rating" << std::endl;
-                            ID3Utilities::setID3Rating(currentFileName, 0, isVerbose);
-                        }
-                    }
-                }
-            }
+            stores[i] = (names[i] == "files" ? static_cast<MetadataStore*>(&files)
+                         : (names[i] == "nepomuk" ? static_cast<MetadataStore*>(&nepomuk) : &amarokDb));
+        }
+        StoreSync sync(*stores[0], *stores[1], forceCopy, isVerbose);
+        if (!sync.run(QFileInfo(workingDirectory).absoluteFilePath(), recurseDirectories))
+        {
+            result = 1;
+        }
+        if (isVerbose || sync.nbChanged() > 0)
+        {
+            std::cout << "Files changed in " << stores[1]->storeName() << ": " << sync.nbChanged() << std::endl;
         }
+    }
 
-        //------------------
-        // Files to Amarok
+    //------------------
+    // Apply a plan: files are processed in parallel with -j
 
-        if (isFilesToAmarok)
+    if (isApply)
+    {
+        ApplyProcessor processor(plannedChanges, useSidecar, isVerbose, isBuffered, &nepomuk, (useAmarok ? &amarokDb : 0));
+        walker.run(plannedFiles, processor);
+        if (!processor.flush())
         {
-            QDirIterator it(workingDirectory, QDir::Files | QDir::NoDotAndDotDot, (recurseDirectories?QDirIterator::Subdirectories:QDirIterator::NoIteratorFlags));
-            while (it.hasNext())
-            {
-                QString currentFileName(it.next());
-
-                if (!it.fileInfo().suffix().compare("mp3", Qt::CaseInsensitive))
-                {
-                    displayFileName(currentFileName, true, isVerbose);
-
-                    int id3rating = 0;
-                    ID3Utilities::getID3Rating(currentFileName, id3rating, isVerbose);
-                    if (id3rating > 0)
-                    {
-                        bool urlPresent = false;
-                        int amarokRating = 0;
-                        amarokDb.getRating(currentFileName, urlPresent, amarokRating);
-                        if (!urlPresent)
-                        {
-                            displayFileName(currentFileName);
-                            std::cout << "  File has rating " << id3rating << " but is not in Amarok collection. Do nothing" << std::endl;
-                        }
-                        else
-                        {
-                            if (id3rating != amarokRating)
-                            {
-                                displayFileName(currentFileName);
-                                std::cout << "  Needs to copy rating: " << id3rating << std::endl;
-                                amarokDb.setRating(currentFileName, id3rating);
-                            }
-                        }
-                    }
-                    else if (forceCopy)
-                    {
-                        bool urlPresent = false;
-                        int amarokRating = 0;
-                        amarokDb.getRating(currentFileName, urlPresent, amarokRating);
-                        if (amarokRating != 0)
-                        {
-                            displayFileName(currentFileName);
-                            std::cout << "  Needs to clear rating" << std::endl;
-                            amarokDb.setRating(currentFileName, id3rating);
-                        }
-                    }
-                }
-            }
+            result = 1;
         }
+        std::cout << "Changes applied: " << processor.nbApplied() << ", skipped: " << processor.nbSkipped() << std::endl;
+    }
 
+    if (useAmarok)
+    {
         //------------------
         // Display Amarok
 
         if (isDisplayAmarok)
         {
-            QMap<QString, int> ratings;
-            amarokDb.getAllRating(workingDirectory, ratings);
-
-            QMap<QString, int>::const_iterator i = ratings.constBegin();
-            while (i != ratings.constEnd())
-            {
-                if (recurseDirectories ||
-                    (i.key().count("/") == workingDirectory.count("/")+1))
-                {
-                    std::cout << QString(i.key().toLocal8Bit()).toStdString() << ": " << i.value() << std::endl;
-                }
-                ++i;
-            }
+            // Depth restriction is done by the query, and ratings are printed in path order as they are read
+            RatingPrinter printer;
+            amarokDb.getAllRating(workingDirectory, printer, recurseDirectories);
+            std::cout.flush();
         }
 
         //------------------
@@ -683,22 +719,19 @@ int main(int argc, char *argv[])
                 std::cout << "Query: " << amarokQuery.toStdString() << std::endl;
             }
 
-            QList<QString> rows;
-            amarokDb.query(amarokQuery, rows);
-
-            QList<QString>::const_iterator row = rows.constBegin();
-            while (row != rows.constEnd())
-            {
-                std::cout << (*row).toStdString() << std::endl;
-                ++row;
-            }
+            // Rows are printed as they are read from the collection
+            DelimitedWriter writer(std::cout, (tsvOutput ? DelimitedWriter::TSV : (csvOutput ? DelimitedWriter::CSV : DelimitedWriter::Plain)));
+            amarokDb.query(amarokQuery, writer);
+            std::cout.flush();
         }
     }
 
+    delete stateCache;
+
     if (!isVerbose)
     {
         fclose(stderr);
     }
 
-    return 0;
+    return result;
 }
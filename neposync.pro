@@ -8,7 +8,21 @@ CONFIG -= app_bundle
 TEMPLATE = app
 SOURCES += main.cpp \
     AmarokCollection.cpp \
-    ID3Utilities.cpp
+    ID3Utilities.cpp \
+    DelimitedWriter.cpp \
+    ImageMetadata.cpp \
+    JPEGUtilities.cpp \
+    FileWalker.cpp \
+    StateCache.cpp \
+    DirectoryWatcher.cpp \
+    FileList.cpp \
+    NepomukCollection.cpp \
+    ChangePlan.cpp \
+    MetadataStore.cpp \
+    FileStore.cpp \
+    SyncFile.cpp \
+    SyncProcessor.cpp \
+    ApplyProcessor.cpp
 
 message($$QMAKE_HOST.arch)
 contains(QMAKE_HOST.arch, "x86_64") {
@@ -32,4 +46,19 @@ LIBS += -lkdeui \
     -lrt
 
 HEADERS += AmarokCollection.h \
-    ID3Utilities.h
+    ID3Utilities.h \
+    DelimitedWriter.h \
+    ImageMetadata.h \
+    JPEGUtilities.h \
+    FileWalker.h \
+    StateCache.h \
+    DirectoryWatcher.h \
+    FileList.h \
+    Pipeline.h \
+    NepomukCollection.h \
+    ChangePlan.h \
+    MetadataStore.h \
+    FileStore.h \
+    SyncFile.h \
+    SyncProcessor.h \
+    ApplyProcessor.h